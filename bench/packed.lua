@@ -0,0 +1,103 @@
+--
+-- compares L:run() and L:run_packed() across payload shapes.
+--
+-- usage: lua bench/packed.lua [niter]
+--
+local newstate = require('newstate')
+local clock = os.clock
+local NITER = tonumber(arg[1]) or 100
+
+local function numbers(n)
+    local list = {}
+    for i = 1, n do
+        list[i] = i * 0.5
+    end
+    return list
+end
+
+local function strings(n)
+    local list = {}
+    for i = 1, n do
+        list[i] = 'value' .. i
+    end
+    return list
+end
+
+local function hash(n)
+    local tbl = {}
+    for i = 1, n do
+        tbl['key' .. i] = i
+    end
+    return tbl
+end
+
+local function records(n)
+    local list = {}
+    for i = 1, n do
+        list[i] = {
+            id = i,
+            name = 'name' .. i,
+            score = i * 0.5,
+            active = i % 2 == 0,
+            tags = {
+                'a',
+                'b',
+                'c',
+            },
+        }
+    end
+    return list
+end
+
+local function nested(depth)
+    local tbl = {}
+    local cur = tbl
+    for i = 1, depth do
+        cur.value = i
+        cur.next = {}
+        cur = cur.next
+    end
+    return tbl
+end
+
+local SHAPES = {
+    {
+        'numbers',
+        numbers(100000),
+    },
+    {
+        'strings',
+        strings(100000),
+    },
+    {
+        'wide hash',
+        hash(100000),
+    },
+    {
+        'records',
+        records(10000),
+    },
+    {
+        'nested',
+        nested(10000),
+    },
+}
+
+local L = assert(newstate.new())
+assert(L:loadstring('return ...'))
+
+local function bench(method, payload)
+    local fn = L[method]
+    local t = clock()
+    for _ = 1, NITER do
+        assert(fn(L, payload))
+    end
+    return (clock() - t) / NITER * 1000
+end
+
+print(('%-12s %14s %14s'):format('shape', 'run ms/call', 'packed ms/call'))
+for _, shape in ipairs(SHAPES) do
+    local name, payload = shape[1], shape[2]
+    print(('%-12s %14.3f %14.3f'):format(name, bench('run', payload),
+                                         bench('run_packed', payload)))
+end
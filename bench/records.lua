@@ -0,0 +1,44 @@
+--
+-- measures the cost of exchanging record-shaped tables.
+--
+-- usage: lua bench/records.lua [nrecord [nfield [niter]]]
+--
+-- to compare two builds, run this script against each newstate.so and
+-- compare the reported times.
+--
+local newstate = require('newstate')
+local clock = os.clock
+local NRECORD = tonumber(arg[1]) or 1000
+local NFIELD = tonumber(arg[2]) or 30
+local NITER = tonumber(arg[3]) or 100
+
+local function records(nrecord, nfield)
+    local list = {}
+    for i = 1, nrecord do
+        local rec = {}
+        for j = 1, nfield do
+            rec['field' .. j] = j % 2 == 0 and j or 'value' .. j
+        end
+        list[i] = rec
+    end
+    return list
+end
+
+local function bench(name, L, payload)
+    local t = clock()
+    for _ = 1, NITER do
+        assert(L:run(payload))
+    end
+    t = clock() - t
+    print(('%-20s %10.3f ms/call %12.1f records/sec'):format(name,
+                                                              t / NITER * 1000,
+                                                              NRECORD * NITER /
+                                                                  t))
+end
+
+local L = assert(newstate.new())
+assert(L:loadstring('return ...'))
+print(('records: %d, fields: %d, iterations: %d'):format(NRECORD, NFIELD,
+                                                          NITER))
+bench('records', L, records(NRECORD, NFIELD))
+bench('wide hash', L, records(1, NRECORD)[1])
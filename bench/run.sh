@@ -0,0 +1,45 @@
+#!/bin/sh
+#
+# builds the module for each Lua version and runs bench/suite.lua with it.
+#
+# usage: bench/run.sh [suite options]
+#
+# environment variables:
+#
+#   LUA_VERSIONS  versions to run (default: "5.1 5.2 5.3 5.4 luajit").
+#                 the versions whose interpreter is not installed are skipped.
+#   BENCH_TREE    luarocks tree to install the builds (default: bench/.tree).
+#
+# the results are written to stdout in the tsv format unless the format is
+# given by the suite options.
+#
+set -e
+
+cd "$(dirname "$0")/.."
+LUA_VERSIONS=${LUA_VERSIONS:-"5.1 5.2 5.3 5.4 luajit"}
+BENCH_TREE=${BENCH_TREE:-bench/.tree}
+ROCKSPEC=rockspecs/newstate-scm-1.rockspec
+
+case " $* " in
+*" -f "*) ;;
+*) set -- -f tsv "$@" ;;
+esac
+
+for v in $LUA_VERSIONS; do
+    if [ "$v" = "luajit" ]; then
+        lua=luajit
+        ver=5.1
+    else
+        lua=lua$v
+        ver=$v
+    fi
+    if ! command -v "$lua" >/dev/null 2>&1; then
+        echo "skip $v: $lua not found" >&2
+        continue
+    fi
+
+    tree="$BENCH_TREE/$v"
+    echo "build $v" >&2
+    luarocks --lua-version="$ver" --tree="$tree" make "$ROCKSPEC" >&2
+    LUA_CPATH="$tree/lib/lua/$ver/?.so;;" "$lua" bench/suite.lua "$@"
+done
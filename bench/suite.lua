@@ -0,0 +1,236 @@
+--
+-- measures the state creation, the exchange of the values and the
+-- invocation of the scripts.
+--
+-- usage: lua bench/suite.lua [-f text|tsv|json] [-n scale] [pattern]
+--
+--   -f format   output format. tsv and json (one object per line) are
+--               intended for the comparison between the builds.
+--   -n scale    multiplier of the number of iterations of each case.
+--   pattern     runs only the cases whose name matches the Lua pattern.
+--
+local newstate = require('newstate')
+local clock = os.clock
+local FORMAT = 'text'
+local SCALE = 1
+local PATTERN
+
+do
+    local i = 1
+    while arg[i] do
+        if arg[i] == '-f' then
+            FORMAT = assert(arg[i + 1], 'missing format')
+            i = i + 1
+        elseif arg[i] == '-n' then
+            SCALE = assert(tonumber(arg[i + 1]), 'invalid scale')
+            i = i + 1
+        else
+            PATTERN = arg[i]
+        end
+        i = i + 1
+    end
+    assert(FORMAT == 'text' or FORMAT == 'tsv' or FORMAT == 'json',
+           'format must be text, tsv or json')
+end
+
+local VERSION = _VERSION
+if type(jit) == 'table' then
+    VERSION = jit.version
+end
+
+local function array(n)
+    local list = {}
+    for i = 1, n do
+        list[i] = i * 0.5
+    end
+    return list
+end
+
+local function hash(n)
+    local tbl = {}
+    for i = 1, n do
+        tbl['key' .. i] = i
+    end
+    return tbl
+end
+
+local function nested(depth)
+    local tbl = {}
+    local cur = tbl
+    for i = 1, depth do
+        cur.value = i
+        cur.next = {}
+        cur = cur.next
+    end
+    return tbl
+end
+
+local GARBAGE = [[
+    local list = {}
+    for i = 1, 1000 do
+        list[i] = {i}
+    end
+]]
+
+local function echo()
+    local L = assert(newstate.new())
+    assert(L:loadstring('return ...'))
+    return L
+end
+
+-- each case returns the function that runs one iteration, and the number of
+-- the iterations.
+local CASES = {}
+
+local function case(name, niter, setup)
+    CASES[#CASES + 1] = {
+        name = name,
+        niter = niter,
+        setup = setup,
+    }
+end
+
+case('new', 1000, function()
+    return function()
+        assert(newstate.new())
+    end
+end)
+
+case('new/noopenlibs', 10000, function()
+    return function()
+        assert(newstate.new(false))
+    end
+end)
+
+case('dostring', 10000, function()
+    local L = assert(newstate.new())
+    return function()
+        assert(L:dostring('return 1'))
+    end
+end)
+
+case('loadstring+run', 10000, function()
+    local L = assert(newstate.new())
+    return function()
+        assert(L:loadstring('return 1'))
+        assert(L:run())
+    end
+end)
+
+case('run', 100000, function()
+    local L = echo()
+    return function()
+        assert(L:run(1))
+    end
+end)
+
+case('exchange/array', 1000, function()
+    local L = echo()
+    local payload = array(1000)
+    return function()
+        assert(L:run(payload))
+    end
+end)
+
+case('exchange/typedarray', 1000, function()
+    local L = echo()
+    local payload = assert(newstate.array('f64', array(1000)))
+    return function()
+        assert(L:run(payload))
+    end
+end)
+
+case('exchange/hash', 1000, function()
+    local L = echo()
+    local payload = hash(1000)
+    return function()
+        assert(L:run(payload))
+    end
+end)
+
+case('exchange/nested', 1000, function()
+    local L = echo()
+    local payload = nested(1000)
+    return function()
+        assert(L:run(payload))
+    end
+end)
+
+case('exchange/string', 1000, function()
+    local L = echo()
+    local payload = string.rep('x', 1024 * 1024)
+    return function()
+        assert(L:run(payload))
+    end
+end)
+
+case('gc/default', 1000, function()
+    local L = assert(newstate.new())
+    assert(L:loadstring(GARBAGE))
+    return function()
+        assert(L:run())
+    end
+end)
+
+for _, mode in ipairs({
+    'GCINC',
+    'GCGEN',
+}) do
+    if newstate[mode] then
+        case('gc/' .. mode:lower(), 1000, function()
+            local L = assert(newstate.new())
+            if not pcall(L.gc, L, newstate[mode]) then
+                return
+            end
+            assert(L:loadstring(GARBAGE))
+            return function()
+                assert(L:run())
+            end
+        end)
+    end
+end
+
+case('gc/collect', 100, function()
+    local L = assert(newstate.new())
+    assert(L:loadstring(GARBAGE))
+    return function()
+        assert(L:run())
+        L:gc(newstate.GCCOLLECT)
+    end
+end)
+
+local function report(name, niter, elapsed)
+    local nsop = elapsed / niter * 1e9
+    if FORMAT == 'tsv' then
+        print(('%s\t%s\t%d\t%.6f\t%.1f'):format(VERSION, name, niter, elapsed,
+                                                 nsop))
+    elseif FORMAT == 'json' then
+        print(('{"lua":%q,"case":%q,"iterations":%d,"seconds":%.6f,' ..
+                  '"ns_per_op":%.1f}'):format(VERSION, name, niter, elapsed,
+                                              nsop))
+    else
+        print(('%-20s %10d iter %12.1f ns/op'):format(name, niter, nsop))
+    end
+end
+
+if FORMAT == 'tsv' then
+    print('lua\tcase\titerations\tseconds\tns_per_op')
+elseif FORMAT == 'text' then
+    print(VERSION)
+end
+
+for _, c in ipairs(CASES) do
+    if not PATTERN or c.name:find(PATTERN) then
+        local fn = c.setup()
+        if fn then
+            local niter = math.max(1, math.floor(c.niter * SCALE))
+            local t
+            collectgarbage('collect')
+            t = clock()
+            for _ = 1, niter do
+                fn()
+            end
+            report(c.name, niter, clock() - t)
+        end
+    end
+end
@@ -0,0 +1,360 @@
+/**
+ *  Copyright (C) 2021 Masatoshi Fukunaga
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ *  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ */
+
+#include "newstate.h"
+#include <limits.h>
+
+static const char *const TYPES[] = {"f64", "f32", "i64", "i32", "u8", NULL};
+
+size_t newstate_array_size(int type) {
+    switch (type) {
+    case ARRAY_F64:
+    case ARRAY_I64:
+        return 8;
+    case ARRAY_F32:
+    case ARRAY_I32:
+        return 4;
+    case ARRAY_U8:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static inline newstate_array_t *checkarray(lua_State *L) {
+    return *(newstate_array_t **)luaL_checkudata(L, 1, ARRAY_MT);
+}
+
+// returns the array at index 1 that can be written.
+static inline newstate_array_t *checkwritable(lua_State *L) {
+    newstate_array_t *arr = checkarray(L);
+
+    if (__atomic_load_n(&arr->readonly, __ATOMIC_ACQUIRE)) {
+        luaL_error(L, "array is read-only");
+    }
+    return arr;
+}
+
+static void getit(lua_State *L, newstate_array_t *arr, size_t i) {
+    switch (arr->type) {
+    case ARRAY_F64:
+        lua_pushnumber(L, ((double *)arr->data)[i]);
+        return;
+    case ARRAY_F32:
+        lua_pushnumber(L, ((float *)arr->data)[i]);
+        return;
+    case ARRAY_I64:
+        lua_pushinteger(L, (lua_Integer)((int64_t *)arr->data)[i]);
+        return;
+    case ARRAY_I32:
+        lua_pushinteger(L, ((int32_t *)arr->data)[i]);
+        return;
+    default:
+        lua_pushinteger(L, ((uint8_t *)arr->data)[i]);
+    }
+}
+
+// converts the value at idx to the element i like the C conversion.
+static void setit(lua_State *L, newstate_array_t *arr, size_t i, int idx) {
+    switch (arr->type) {
+    case ARRAY_F64:
+        ((double *)arr->data)[i] = (double)luaL_checknumber(L, idx);
+        return;
+    case ARRAY_F32:
+        ((float *)arr->data)[i] = (float)luaL_checknumber(L, idx);
+        return;
+    case ARRAY_I64:
+        ((int64_t *)arr->data)[i] = (int64_t)luaL_checkinteger(L, idx);
+        return;
+    case ARRAY_I32:
+        ((int32_t *)arr->data)[i] = (int32_t)luaL_checkinteger(L, idx);
+        return;
+    default:
+        ((uint8_t *)arr->data)[i] = (uint8_t)luaL_checkinteger(L, idx);
+    }
+}
+
+// returns the position of the integer key at idx, or 0 if it is not in the
+// range of the array.
+static inline size_t checkpos(lua_State *L, newstate_array_t *arr, int idx) {
+    lua_Number n = 0;
+
+#if LUA_VERSION_NUM >= 503
+    if (lua_isinteger(L, idx)) {
+        lua_Integer i = lua_tointeger(L, idx);
+        return i >= 1 && (uint64_t)i <= arr->len ? (size_t)i : 0;
+    }
+#endif
+    n = lua_tonumber(L, idx);
+    if (n >= 1 && n <= (lua_Number)arr->len && n == (lua_Number)(size_t)n) {
+        return (size_t)n;
+    }
+    return 0;
+}
+
+// converts the range [i, j] at idx and idx + 1 like string.sub, and returns
+// the number of the elements in the range.
+static size_t checkrange(lua_State *L, newstate_array_t *arr, int idx,
+                         size_t *i) {
+    lua_Integer s = luaL_optinteger(L, idx, 1);
+    lua_Integer e = luaL_optinteger(L, idx + 1, (lua_Integer)arr->len);
+
+    if (s < 0) {
+        s += (lua_Integer)arr->len + 1;
+    }
+    if (e < 0) {
+        e += (lua_Integer)arr->len + 1;
+    }
+    if (s < 1) {
+        s = 1;
+    }
+    if (e > (lua_Integer)arr->len) {
+        e = (lua_Integer)arr->len;
+    }
+    *i = (size_t)s - 1;
+    return s <= e ? (size_t)(e - s + 1) : 0;
+}
+
+static int index_lua(lua_State *L) {
+    newstate_array_t *arr = checkarray(L);
+    size_t i              = 0;
+
+    if (lua_type(L, 2) == LUA_TNUMBER) {
+        if ((i = checkpos(L, arr, 2))) {
+            getit(L, arr, i - 1);
+            return 1;
+        }
+        lua_pushnil(L);
+        return 1;
+    }
+    // methods
+    lua_settop(L, 2);
+    lua_rawget(L, lua_upvalueindex(1));
+    return 1;
+}
+
+static int newindex_lua(lua_State *L) {
+    newstate_array_t *arr = checkwritable(L);
+    size_t i              = 0;
+
+    if (lua_type(L, 2) != LUA_TNUMBER || !(i = checkpos(L, arr, 2))) {
+        return luaL_error(L, "array index out of range");
+    }
+    setit(L, arr, i - 1, 3);
+    return 0;
+}
+
+static int len_lua(lua_State *L) {
+    newstate_array_t *arr = checkarray(L);
+    lua_pushinteger(L, (lua_Integer)arr->len);
+    return 1;
+}
+
+static int readonly_lua(lua_State *L) {
+    newstate_array_t *arr = checkarray(L);
+    lua_pushboolean(L, __atomic_load_n(&arr->readonly, __ATOMIC_ACQUIRE));
+    return 1;
+}
+
+static int type_lua(lua_State *L) {
+    newstate_array_t *arr = checkarray(L);
+    lua_pushstring(L, TYPES[arr->type]);
+    return 1;
+}
+
+// fills the range [i, j] with v.
+static int fill_lua(lua_State *L) {
+    newstate_array_t *arr = checkwritable(L);
+    size_t i              = 0;
+    size_t n              = 0;
+
+    luaL_checkany(L, 2);
+    n = checkrange(L, arr, 3, &i);
+    if (n) {
+        size_t size = newstate_array_size(arr->type);
+        char *p     = arr->data + i * size;
+        char *e     = p + n * size;
+
+        setit(L, arr, i, 2);
+        for (p += size; p < e; p += size) {
+            memcpy(p, p - size, size);
+        }
+    }
+    return 0;
+}
+
+// copies the sequence of the table into the array from the position i.
+static int set_lua(lua_State *L) {
+    newstate_array_t *arr = checkwritable(L);
+    lua_Integer pos       = 0;
+    size_t len            = 0;
+    size_t i              = 0;
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+    pos = luaL_optinteger(L, 3, 1);
+    len = (size_t)tbllen(L, 2);
+    luaL_argcheck(L, pos >= 1 && (uint64_t)pos - 1 <= arr->len, 3,
+                  "position out of range");
+    luaL_argcheck(L, len <= arr->len - (size_t)(pos - 1), 2,
+                  "table is longer than the array");
+    for (; i < len; i++) {
+        lua_rawgeti(L, 2, (int)i + 1);
+        setit(L, arr, (size_t)pos - 1 + i, -1);
+        lua_pop(L, 1);
+    }
+    return 0;
+}
+
+// returns the elements in the range [i, j] as a table.
+static int totable_lua(lua_State *L) {
+    newstate_array_t *arr = checkarray(L);
+    size_t i              = 0;
+    size_t n              = checkrange(L, arr, 2, &i);
+    size_t k              = 1;
+
+    luaL_argcheck(L, n <= INT_MAX, 2, "range too large");
+    lua_createtable(L, (int)n, 0);
+    for (; k <= n; k++, i++) {
+        getit(L, arr, i);
+        lua_rawseti(L, -2, (int)k);
+    }
+    return 1;
+}
+
+static int tostring_lua(lua_State *L) {
+    lua_pushfstring(L, ARRAY_MT ": %p", lua_touserdata(L, 1));
+    return 1;
+}
+
+static int gc_lua(lua_State *L) {
+    newstate_array_t **arr = (newstate_array_t **)lua_touserdata(L, 1);
+
+    if (*arr && refcnt_decr(&(*arr)->refcnt) == 0) {
+        free(*arr);
+    }
+    *arr = NULL;
+    return 0;
+}
+
+void newstate_array_init(lua_State *L) {
+    struct luaL_Reg mmethods[] = {
+        {"__gc", gc_lua},
+        {"__newindex", newindex_lua},
+        {"__len", len_lua},
+        {"__tostring", tostring_lua},
+        {NULL, NULL},
+    };
+    struct luaL_Reg methods[] = {
+        {"len", len_lua},   {"type", type_lua},
+        {"fill", fill_lua}, {"set", set_lua},
+        {"totable", totable_lua}, {"readonly", readonly_lua},
+        {NULL, NULL},
+    };
+    struct luaL_Reg *fn = mmethods;
+
+    luaL_getmetatable(L, ARRAY_MT);
+    if (lua_isnil(L, -1)) {
+        luaL_newmetatable(L, ARRAY_MT);
+        for (; fn->name; fn++) {
+            lua_pushstring(L, fn->name);
+            lua_pushcfunction(L, fn->func);
+            lua_rawset(L, -3);
+        }
+        // the elements and the methods are looked up by __index
+        lua_pushliteral(L, "__index");
+        lua_newtable(L);
+        for (fn = methods; fn->name; fn++) {
+            lua_pushstring(L, fn->name);
+            lua_pushcfunction(L, fn->func);
+            lua_rawset(L, -3);
+        }
+        lua_pushcclosure(L, index_lua, 1);
+        lua_rawset(L, -3);
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+}
+
+void newstate_array_push(lua_State *L, newstate_array_t *arr) {
+    newstate_array_t **ud = lua_newuserdata(L, sizeof(newstate_array_t *));
+
+    *ud = NULL;
+    newstate_array_init(L);
+    luaL_getmetatable(L, ARRAY_MT);
+    lua_setmetatable(L, -2);
+    refcnt_incr(&arr->refcnt);
+    __atomic_store_n(&arr->readonly, 1, __ATOMIC_RELEASE);
+    *ud = arr;
+}
+
+int newstate_array_pushnew(lua_State *L, int type, size_t len,
+                           const char *data) {
+    size_t size           = newstate_array_size(type);
+    newstate_array_t **ud = NULL;
+
+    if (!size || len > (SIZE_MAX - sizeof(newstate_array_t)) / size) {
+        return -1;
+    }
+    ud  = lua_newuserdata(L, sizeof(newstate_array_t *));
+    *ud = NULL;
+    newstate_array_init(L);
+    luaL_getmetatable(L, ARRAY_MT);
+    lua_setmetatable(L, -2);
+    if (!(*ud = data ? malloc(sizeof(newstate_array_t) + len * size)
+                     : calloc(1, sizeof(newstate_array_t) + len * size))) {
+        lua_pop(L, 1);
+        return -1;
+    }
+    (*ud)->refcnt   = 1;
+    (*ud)->type     = type;
+    (*ud)->readonly = 0;
+    (*ud)->len      = len;
+    if (data) {
+        memcpy((*ud)->data, data, len * size);
+    }
+    return 0;
+}
+
+int newstate_array_lua(lua_State *L) {
+    int type        = luaL_checkoption(L, 1, NULL, TYPES);
+    lua_Integer len = 0;
+
+    if (lua_istable(L, 2)) {
+        len = (lua_Integer)tbllen(L, 2);
+    } else {
+        len = luaL_checkinteger(L, 2);
+        luaL_argcheck(L, len >= 0, 2,
+                      "length must be greater than or equal to 0");
+    }
+    lua_settop(L, 2);
+    if (newstate_array_pushnew(L, type, (size_t)len, NULL)) {
+        lua_pushnil(L);
+        return 1;
+    } else if (lua_istable(L, 2)) {
+        // arr:set(tbl)
+        lua_pushcfunction(L, set_lua);
+        lua_pushvalue(L, 3);
+        lua_pushvalue(L, 2);
+        lua_call(L, 2, 0);
+    }
+    return 1;
+}
@@ -0,0 +1,194 @@
+/**
+ *  Copyright (C) 2021 Masatoshi Fukunaga
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ *  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ */
+
+#include "newstate.h"
+
+static inline newstate_buffer_t *checkbuffer(lua_State *L) {
+    return *(newstate_buffer_t **)luaL_checkudata(L, 1, BUFFER_MT);
+}
+
+// converts the relative position to the absolute position like string.sub.
+static inline size_t posrelat(lua_Integer pos, size_t len) {
+    if (pos >= 0) {
+        return (size_t)pos;
+    } else if ((size_t)-pos > len) {
+        return 0;
+    }
+    return len + (size_t)pos + 1;
+}
+
+static int len_lua(lua_State *L) {
+    newstate_buffer_t *buf = checkbuffer(L);
+    lua_pushinteger(L, (lua_Integer)buf->len);
+    return 1;
+}
+
+static int sub_lua(lua_State *L) {
+    newstate_buffer_t *buf = checkbuffer(L);
+    size_t i               = posrelat(luaL_optinteger(L, 2, 1), buf->len);
+    size_t j               = posrelat(luaL_optinteger(L, 3, -1), buf->len);
+
+    if (i < 1) {
+        i = 1;
+    }
+    if (j > buf->len) {
+        j = buf->len;
+    }
+    if (i > j) {
+        lua_pushliteral(L, "");
+    } else {
+        lua_pushlstring(L, buf->data + i - 1, j - i + 1);
+    }
+    return 1;
+}
+
+static int byte_lua(lua_State *L) {
+    newstate_buffer_t *buf = checkbuffer(L);
+    lua_Integer pi         = luaL_optinteger(L, 2, 1);
+    size_t i               = posrelat(pi, buf->len);
+    size_t j               = posrelat(luaL_optinteger(L, 3, pi), buf->len);
+    int n                  = 0;
+
+    if (i < 1) {
+        i = 1;
+    }
+    if (j > buf->len) {
+        j = buf->len;
+    }
+    if (i > j) {
+        return 0;
+    }
+    n = (int)(j - i + 1);
+    luaL_checkstack(L, n, "string slice too long");
+    for (; i <= j; i++) {
+        lua_pushinteger(L, (unsigned char)buf->data[i - 1]);
+    }
+    return n;
+}
+
+// finds the first occurrence of the plain string.
+static int find_lua(lua_State *L) {
+    newstate_buffer_t *buf = checkbuffer(L);
+    size_t len             = 0;
+    const char *s          = luaL_checklstring(L, 2, &len);
+    size_t init            = posrelat(luaL_optinteger(L, 3, 1), buf->len);
+    const char *p          = NULL;
+    const char *e          = NULL;
+
+    if (init < 1) {
+        init = 1;
+    } else if (init > buf->len + 1) {
+        lua_pushnil(L);
+        return 1;
+    } else if (len == 0) {
+        lua_pushinteger(L, (lua_Integer)init);
+        lua_pushinteger(L, (lua_Integer)init - 1);
+        return 2;
+    }
+
+    p = buf->data + init - 1;
+    e = buf->data + buf->len;
+    while ((size_t)(e - p) >= len &&
+           (p = memchr(p, *s, (size_t)(e - p) - len + 1)) != NULL) {
+        if (memcmp(p, s, len) == 0) {
+            lua_Integer pos = (lua_Integer)(p - buf->data) + 1;
+            lua_pushinteger(L, pos);
+            lua_pushinteger(L, pos + (lua_Integer)len - 1);
+            return 2;
+        }
+        p++;
+    }
+    lua_pushnil(L);
+    return 1;
+}
+
+static int tostring_lua(lua_State *L) {
+    lua_pushfstring(L, BUFFER_MT ": %p", lua_touserdata(L, 1));
+    return 1;
+}
+
+static int gc_lua(lua_State *L) {
+    newstate_buffer_t **buf = (newstate_buffer_t **)lua_touserdata(L, 1);
+
+    if (*buf && refcnt_decr(&(*buf)->refcnt) == 0) {
+        free(*buf);
+    }
+    *buf = NULL;
+    return 0;
+}
+
+void newstate_buffer_init(lua_State *L) {
+    struct luaL_Reg mmethods[] = {
+        {"__gc", gc_lua},
+        {"__len", len_lua},
+        {"__tostring", tostring_lua},
+        {NULL, NULL},
+    };
+    struct luaL_Reg methods[] = {
+        {"len", len_lua},   {"sub", sub_lua}, {"byte", byte_lua},
+        {"find", find_lua}, {NULL, NULL},
+    };
+
+    luaL_getmetatable(L, BUFFER_MT);
+    if (lua_isnil(L, -1)) {
+        newstate_createmetatable(L, BUFFER_MT, mmethods, methods);
+    }
+    lua_pop(L, 1);
+}
+
+void newstate_buffer_push(lua_State *L, newstate_buffer_t *buf) {
+    newstate_buffer_t **ud = lua_newuserdata(L, sizeof(newstate_buffer_t *));
+
+    *ud = NULL;
+    newstate_buffer_init(L);
+    luaL_getmetatable(L, BUFFER_MT);
+    lua_setmetatable(L, -2);
+    refcnt_incr(&buf->refcnt);
+    *ud = buf;
+}
+
+int newstate_buffer_pushnew(lua_State *L, const char *s, size_t len) {
+    newstate_buffer_t **ud = lua_newuserdata(L, sizeof(newstate_buffer_t *));
+
+    *ud = NULL;
+    newstate_buffer_init(L);
+    luaL_getmetatable(L, BUFFER_MT);
+    lua_setmetatable(L, -2);
+    if (!(*ud = malloc(sizeof(newstate_buffer_t) + len))) {
+        lua_pop(L, 1);
+        return -1;
+    }
+    (*ud)->refcnt = 1;
+    (*ud)->len    = len;
+    memcpy((*ud)->data, s, len);
+    return 0;
+}
+
+int newstate_buffer_lua(lua_State *L) {
+    size_t len    = 0;
+    const char *s = luaL_checklstring(L, 1, &len);
+
+    if (newstate_buffer_pushnew(L, s, len)) {
+        lua_pushnil(L);
+    }
+    return 1;
+}
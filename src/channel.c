@@ -0,0 +1,249 @@
+/**
+ *  Copyright (C) 2021 Masatoshi Fukunaga
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ *  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ */
+
+#include "newstate.h"
+#include <errno.h>
+
+typedef struct {
+    char *data;
+    size_t len;
+} chitem_t;
+
+struct newstate_channel_t {
+    int refcnt;
+    pthread_mutex_t mutex;
+    pthread_cond_t nonempty;
+    int closed;
+    size_t cap;
+    size_t head;
+    size_t count;
+    chitem_t items[];
+};
+
+static inline newstate_channel_t *checkchannel(lua_State *L) {
+    return *(newstate_channel_t **)luaL_checkudata(L, 1, CHANNEL_MT);
+}
+
+static int push_lua(lua_State *L) {
+    newstate_channel_t *ch = checkchannel(L);
+    newstate_pack_t pk;
+    chitem_t item = {NULL, 0};
+    int rc        = 0;
+
+    newstate_pack_init(&pk);
+    if ((rc = newstate_pack(L, 2, lua_gettop(L), &pk))) {
+        newstate_pack_free(&pk);
+        lua_pushboolean(L, 0);
+        if (rc < 0) {
+            lua_pushliteral(L, "not enough memory");
+        } else {
+            lua_pushfstring(L, "cannot push <%s> value", lua_typename(L, rc));
+        }
+        return 2;
+    } else if (!(item.data = malloc(pk.len))) {
+        newstate_pack_free(&pk);
+        lua_pushboolean(L, 0);
+        lua_pushliteral(L, "not enough memory");
+        return 2;
+    }
+    memcpy(item.data, pk.buf, pk.len);
+    item.len = pk.len;
+    newstate_pack_free(&pk);
+
+    pthread_mutex_lock(&ch->mutex);
+    if (ch->closed || ch->count == ch->cap) {
+        pthread_mutex_unlock(&ch->mutex);
+        free(item.data);
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+    ch->items[(ch->head + ch->count) % ch->cap] = item;
+    ch->count++;
+    pthread_cond_signal(&ch->nonempty);
+    pthread_mutex_unlock(&ch->mutex);
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static int pop_lua(lua_State *L) {
+    newstate_channel_t *ch = checkchannel(L);
+    lua_Number timeout     = luaL_optnumber(L, 2, -1);
+    struct timespec deadline;
+    chitem_t item = {NULL, 0};
+    int n         = 0;
+
+    if (timeout > 0) {
+        deadlineit(&deadline, timeout);
+    }
+
+    pthread_mutex_lock(&ch->mutex);
+    while (!ch->count && !ch->closed && timeout != 0) {
+        if (timeout < 0) {
+            pthread_cond_wait(&ch->nonempty, &ch->mutex);
+        } else if (pthread_cond_timedwait(&ch->nonempty, &ch->mutex,
+                                          &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    if (ch->count) {
+        item     = ch->items[ch->head];
+        ch->head = (ch->head + 1) % ch->cap;
+        ch->count--;
+    }
+    pthread_mutex_unlock(&ch->mutex);
+
+    if (!item.data) {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+    lua_settop(L, 1);
+    lua_pushboolean(L, 1);
+    n = newstate_unpack(L, item.data, item.len);
+    free(item.data);
+    if (n < 0) {
+        return luaL_error(L, "malformed packed data");
+    }
+    return 1 + n;
+}
+
+static int close_lua(lua_State *L) {
+    newstate_channel_t *ch = checkchannel(L);
+
+    pthread_mutex_lock(&ch->mutex);
+    ch->closed = 1;
+    pthread_cond_broadcast(&ch->nonempty);
+    pthread_mutex_unlock(&ch->mutex);
+    return 0;
+}
+
+static int len_lua(lua_State *L) {
+    newstate_channel_t *ch = checkchannel(L);
+    size_t count           = 0;
+
+    pthread_mutex_lock(&ch->mutex);
+    count = ch->count;
+    pthread_mutex_unlock(&ch->mutex);
+    lua_pushinteger(L, (lua_Integer)count);
+    return 1;
+}
+
+static int cap_lua(lua_State *L) {
+    newstate_channel_t *ch = checkchannel(L);
+    lua_pushinteger(L, (lua_Integer)ch->cap);
+    return 1;
+}
+
+static int tostring_lua(lua_State *L) {
+    lua_pushfstring(L, CHANNEL_MT ": %p", lua_touserdata(L, 1));
+    return 1;
+}
+
+static void release(newstate_channel_t *ch) {
+    if (refcnt_decr(&ch->refcnt) == 0) {
+        for (; ch->count; ch->count--) {
+            free(ch->items[ch->head].data);
+            ch->head = (ch->head + 1) % ch->cap;
+        }
+        pthread_cond_destroy(&ch->nonempty);
+        pthread_mutex_destroy(&ch->mutex);
+        free(ch);
+    }
+}
+
+static int gc_lua(lua_State *L) {
+    newstate_channel_t **ch = (newstate_channel_t **)lua_touserdata(L, 1);
+
+    if (*ch) {
+        release(*ch);
+        *ch = NULL;
+    }
+    return 0;
+}
+
+void newstate_channel_init(lua_State *L) {
+    struct luaL_Reg mmethods[] = {
+        {"__gc", gc_lua},
+        {"__len", len_lua},
+        {"__tostring", tostring_lua},
+        {NULL, NULL},
+    };
+    struct luaL_Reg methods[] = {
+        {"push", push_lua},   {"pop", pop_lua}, {"close", close_lua},
+        {"len", len_lua},     {"cap", cap_lua}, {NULL, NULL},
+    };
+
+    luaL_getmetatable(L, CHANNEL_MT);
+    if (lua_isnil(L, -1)) {
+        newstate_createmetatable(L, CHANNEL_MT, mmethods, methods);
+    }
+    lua_pop(L, 1);
+}
+
+void newstate_channel_push(lua_State *L, newstate_channel_t *ch) {
+    newstate_channel_t **ud = lua_newuserdata(L, sizeof(newstate_channel_t *));
+
+    *ud = NULL;
+    newstate_channel_init(L);
+    luaL_getmetatable(L, CHANNEL_MT);
+    lua_setmetatable(L, -2);
+    refcnt_incr(&ch->refcnt);
+    *ud = ch;
+}
+
+int newstate_channel_lua(lua_State *L) {
+    lua_Integer cap = luaL_checkinteger(L, 1);
+    newstate_channel_t **ud = NULL;
+    newstate_channel_t *ch  = NULL;
+
+    luaL_argcheck(L, cap > 0, 1, "capacity must be greater than 0");
+    luaL_argcheck(L,
+                  (uint64_t)cap <= (SIZE_MAX - sizeof(newstate_channel_t)) /
+                                       sizeof(chitem_t),
+                  1, "capacity too large");
+    ud  = lua_newuserdata(L, sizeof(newstate_channel_t *));
+    *ud = NULL;
+    luaL_getmetatable(L, CHANNEL_MT);
+    lua_setmetatable(L, -2);
+
+    if (!(ch = malloc(sizeof(newstate_channel_t) +
+                      sizeof(chitem_t) * (size_t)cap))) {
+        lua_pushnil(L);
+        return 1;
+    } else if (pthread_mutex_init(&ch->mutex, NULL) != 0) {
+        free(ch);
+        lua_pushnil(L);
+        return 1;
+    } else if (pthread_cond_init(&ch->nonempty, NULL) != 0) {
+        pthread_mutex_destroy(&ch->mutex);
+        free(ch);
+        lua_pushnil(L);
+        return 1;
+    }
+    ch->refcnt = 1;
+    ch->closed = 0;
+    ch->cap    = (size_t)cap;
+    ch->head   = 0;
+    ch->count  = 0;
+    *ud        = ch;
+    return 1;
+}
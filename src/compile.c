@@ -0,0 +1,129 @@
+/**
+ *  Copyright (C) 2021 Masatoshi Fukunaga
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ *  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ */
+
+#include "newstate.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if LUA_VERSION_NUM >= 503
+#    define dumpfunc(L, writer, ud) lua_dump(L, writer, ud, 0)
+#else
+#    define dumpfunc(L, writer, ud) lua_dump(L, writer, ud)
+#endif
+
+typedef struct {
+    const char *data;
+    size_t len;
+} mmreader_t;
+
+static const char *mmread(lua_State *L, void *ud, size_t *sz) {
+    mmreader_t *r = (mmreader_t *)ud;
+
+    (void)L;
+    *sz    = r->len;
+    r->len = 0;
+    return *sz ? r->data : NULL;
+}
+
+int newstate_loadmmap(lua_State *L, const char *path, const char *chunkname) {
+    int fd       = open(path, O_RDONLY);
+    mmreader_t r = {NULL, 0};
+    void *p      = MAP_FAILED;
+    struct stat st;
+    int rc = 0;
+
+    if (fd == -1) {
+        lua_pushfstring(L, "cannot open %s: %s", path, strerror(errno));
+        return LUA_ERRFILE;
+    } else if (fstat(fd, &st) != 0 || st.st_size == 0 ||
+               (p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd,
+                         0)) == MAP_FAILED) {
+        lua_pushfstring(L, "cannot read %s: %s", path,
+                        st.st_size ? strerror(errno) : "empty file");
+        close(fd);
+        return LUA_ERRFILE;
+    }
+    close(fd);
+
+    r.data = (const char *)p;
+    r.len  = (size_t)st.st_size;
+    rc     = loadreader(L, mmread, &r, chunkname);
+    munmap(p, (size_t)st.st_size);
+    return rc;
+}
+
+static int dumpwriter(lua_State *L, const void *p, size_t sz, void *ud) {
+    (void)L;
+    return fwrite(p, 1, sz, (FILE *)ud) != sz;
+}
+
+int newstate_dumpfile(lua_State *L, const char *path) {
+    size_t len = strlen(path);
+    char *tmp  = malloc(len + 32);
+    FILE *fp   = NULL;
+    int rc     = 0;
+
+    if (!tmp) {
+        errno = ENOMEM;
+        return -1;
+    }
+    // write to the temporary file and rename it, so that the other processes
+    // never read the incomplete file.
+    snprintf(tmp, len + 32, "%s.%ld.tmp", path, (long)getpid());
+    if (!(fp = fopen(tmp, "wb"))) {
+        free(tmp);
+        return -1;
+    }
+    rc = dumpfunc(L, dumpwriter, fp);
+    if (fclose(fp) != 0 || rc != 0 || rename(tmp, path) != 0) {
+        int err = errno;
+
+        unlink(tmp);
+        free(tmp);
+        errno = err ? err : EIO;
+        return -1;
+    }
+    free(tmp);
+    return 0;
+}
+
+int newstate_compile_lua(lua_State *L) {
+    const char *path = luaL_checkstring(L, 1);
+    const char *out  = luaL_checkstring(L, 2);
+
+    lua_settop(L, 2);
+    if (luaL_loadfile(L, path) != 0) {
+        lua_pushboolean(L, 0);
+        lua_insert(L, -2);
+        return 2;
+    } else if (newstate_dumpfile(L, out) != 0) {
+        lua_pushboolean(L, 0);
+        lua_pushfstring(L, "cannot write %s: %s", out, strerror(errno));
+        return 2;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
@@ -20,29 +20,308 @@
  *  DEALINGS IN THE SOFTWARE.
  */
 
+#include "newstate.h"
 #include <errno.h>
-#include <lauxlib.h>
-#include <lua.h>
+#include <limits.h>
+#include <stdlib.h>
 #include <lualib.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
-#define MODULE_MT "newstate"
+typedef struct {
+    // number of entries; power of 2, or 0 if disabled
+    size_t size;
+    // addresses of the cached source strings
+    const char **ptrs;
+    // reference to the table of the source strings in the parent state
+    int ref_src;
+    // reference to the table of the interned strings in the child state
+    int ref_dst;
+    size_t hits;
+    size_t misses;
+} strcache_t;
+
+// size classes of the arena allocator: ALLOC_ALIGN * (1 .. ALLOC_NCLASS)
+#define ALLOC_ALIGN     16
+#define ALLOC_NCLASS    16
+#define ALLOC_MAXSMALL  (ALLOC_ALIGN * ALLOC_NCLASS)
+#define ALLOC_CHUNKSIZE (64 * 1024)
+// number of buckets of the allocation size histogram: 8 bytes .. 64MB
+#define ALLOC_NHIST     24
+
+typedef struct alloc_chunk_t {
+    struct alloc_chunk_t *next;
+} alloc_chunk_t;
+
+typedef struct {
+    // memory limit in bytes, or 0 if unlimited
+    size_t limit;
+    // bytes in use by the lua_State
+    size_t used;
+    // limit is enforced only while the child state runs the script
+    int active;
+    // use the arena allocator for the small blocks
+    int arena;
+    void *freelist[ALLOC_NCLASS];
+    alloc_chunk_t *chunks;
+    char *cur;
+    size_t avail;
+    // number of the blocks of malloc() that have the size of a class, since
+    // they could not be moved into the arena when shrunk
+    size_t nforeign;
+    // statistics
+    size_t peak;
+    size_t nalloc;
+    size_t nfree;
+    size_t nrealloc;
+    size_t nfail;
+    // number of the allocations of size in (2^(i+2), 2^(i+3)] bytes.
+    // the first bucket also counts the smaller ones and the last bucket
+    // also counts the larger ones.
+    size_t hist[ALLOC_NHIST];
+} newstate_alloc_t;
+
+#define LIMIT_INTERVAL 1000
+
+typedef struct {
+    // limits; 0 means unlimited
+    lua_Number timeout;
+    lua_Integer instructions;
+    // number of the instructions between the checks
+    int interval;
+    // per-call state
+    struct timespec deadline;
+    lua_Integer remain;
+    const char *exceeded;
+} limit_t;
+
+#define GCPOLICY_NONE 0
+#define GCPOLICY_STEP 1
+#define GCPOLICY_COLLECT 2
+
+typedef struct {
+    // work of the garbage collector after each run
+    int after;
+    int stepkb;
+    // performs a full collection every fullevery runs; 0 means never
+    lua_Integer fullevery;
+    // stops the garbage collector while the function runs
+    int stop;
+    lua_Integer nrun;
+} gcpolicy_t;
+
+#define GCMODE_INC 0
+#define GCMODE_GEN 1
+
+// default parameters of the collector of Lua 5.4
+#define GC_STEPSIZE 13
+#define GC_MINORMUL 20
+#define GC_MAJORMUL 100
+
+typedef struct {
+    int mode;
+    // parameters that cannot be read back from the collector
+    int stepsize;
+    int minormul;
+    int majormul;
+    // set by L:gc() to stop the collector, since Lua 5.1 cannot tell whether
+    // the collector is running
+    int stopped;
+} gcmode_t;
+
+typedef struct {
+    // hash of the source code or the pathname
+    uint64_t hash;
+    // length of the source code or the pathname
+    size_t len;
+    // modification time in nanoseconds, inode number and size of the file
+    int64_t mtime;
+    ino_t ino;
+    off_t fsize;
+    int isfile;
+    // neighbors in the list of the entries in the order of use. the entries
+    // are numbered from 1, and 0 means none.
+    size_t prev;
+    size_t next;
+} chunkent_t;
+
+typedef struct {
+    // maximum number of the entries, or 0 if disabled
+    size_t size;
+    size_t count;
+    chunkent_t *ents;
+    // most and least recently used entries
+    size_t head;
+    size_t tail;
+    // reference to the table in the child state that holds the function of
+    // the entry i at 2i-1, and its source code or pathname at 2i. the hash of
+    // the entry is mapped to i as a light userdata key.
+    int ref;
+    size_t hits;
+    size_t misses;
+} chunkcache_t;
+
+#define CACHEDIR_MAX 1024
+
+typedef struct {
+    int openlibs;
+    // bits of the libraries to open, and whether to open them lazily
+    unsigned libs;
+    int lazy;
+    lua_Integer strcache;
+    lua_Integer chunkcache;
+    size_t memlimit;
+    int arena;
+    // directory of the precompiled chunks of loadfile; empty if disabled
+    char cachedir[CACHEDIR_MAX];
+} newstate_opts_t;
+
+// exchange cost in one direction
+typedef struct {
+    // number of the values including the keys and values in the tables
+    size_t nvalue;
+    // bytes of the string data copied
+    size_t nbyte;
+    size_t ntbl;
+    int maxdepth;
+    uint64_t ns;
+} xmetrics_t;
+
+typedef struct {
+    // number of the calls of the script and the time spent in them
+    size_t ncall;
+    uint64_t ns;
+    // values moved into and out of the child state
+    xmetrics_t in;
+    xmetrics_t out;
+} metrics_t;
 
 typedef struct {
     lua_State *L;
+    newstate_alloc_t alloc;
+    // options of new() to create the clone
+    newstate_opts_t opts;
+    limit_t limit;
+    gcpolicy_t gcpolicy;
+    gcmode_t gcmode;
+    // push the traceback with the error of the script
+    int traceback;
+    newstate_prof_t prof;
+    // number of the instructions between the count hooks
+    int hookcount;
     int ref_fn;
+    // reference to the table of the named functions
+    int ref_fns;
+    // reference to the snapshot of the globals taken by the pool, and
+    // whether the newstate is released to the pool
+    int ref_snapshot;
+    int released;
+    // newstate that the child state was moved to on the release, and the
+    // reference to keep it while this handle is alive
+    void *moved;
+    int ref_moved;
+    strcache_t strcache;
+    chunkcache_t chunkcache;
+    metrics_t metrics;
+    // thread that runs the function spawned by L:spawn()
+    pthread_t tid;
+    int thread;
+    // set while L:load() calls the reader function in the parent state
+    int busy;
+    int done;
+    int rc;
+    // references of the child state to be released once it is not in use
+    int *unrefs;
+    int nunref;
+    int capunref;
 } newstate_t;
 
-#if (LUA_VERSION_NUM > 501)
-#    define tbllen(L, idx) lua_rawlen(L, idx)
+// returns the newstate that owns the child state L.
+static inline newstate_t *getstate(lua_State *L) {
+    void *ud = NULL;
+
+    lua_getallocf(L, &ud);
+    return (newstate_t *)((char *)ud - offsetof(newstate_t, alloc));
+}
+
+// returns the path of the precompiled chunk of the file in the cachedir, or
+// NULL if the path cannot be resolved.
+static char *cachepath(const char *cachedir, const char *file, char *buf,
+                       size_t size) {
+    char real[PATH_MAX];
+    size_t len = 0;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i   = 0;
+
+    if (!realpath(file, real)) {
+        return NULL;
+    }
+    // FNV-1a of the absolute path
+    len = strlen(real);
+    for (; i < len; i++) {
+        h ^= (unsigned char)real[i];
+        h *= 0x100000001b3ULL;
+    }
+    if ((size_t)snprintf(buf, size, "%s/%016llx.luac", cachedir,
+                         (unsigned long long)h) >= size) {
+        return NULL;
+    }
+    return buf;
+}
+
+// returns the modification time of the file in nanoseconds, so the file
+// modified twice within a second is not served from the stale entry.
+static inline int64_t mtimeit(const struct stat *st) {
+#if defined(__APPLE__)
+    return (int64_t)st->st_mtimespec.tv_sec * 1000000000 +
+           st->st_mtimespec.tv_nsec;
 #else
-#    define tbllen(L, idx) lua_objlen(L, idx)
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
 #endif
+}
+
+// loads the file through the precompiled chunk in the cachedir if it is not
+// older than the file. otherwise, loads the file and updates the chunk.
+static int loadprecompiled(lua_State *L, const char *cachedir,
+                           const char *file) {
+    char path[CACHEDIR_MAX + 32];
+    struct stat src;
+    struct stat bin;
+    int rc = 0;
+
+    if (stat(file, &src) != 0 ||
+        !cachepath(cachedir, file, path, sizeof(path))) {
+        return luaL_loadfile(L, file);
+    } else if (stat(path, &bin) == 0 && mtimeit(&bin) >= mtimeit(&src)) {
+        lua_pushfstring(L, "@%s", file);
+        if (newstate_loadmmap(L, path, lua_tostring(L, -1)) == 0) {
+            lua_remove(L, -2);
+            return 0;
+        }
+        // discard the broken chunk and load the file
+        lua_pop(L, 2);
+    }
+
+    if ((rc = luaL_loadfile(L, file)) == 0) {
+        // the cache is an optimization, so the write error is ignored
+        newstate_dumpfile(L, path);
+    }
+    return rc;
+}
 
 static inline int loadfile(lua_State *L, const char *s, size_t len,
                            const char *name) {
+    newstate_t *state = getstate(L);
+
     (void)len;
     (void)name;
+    if (*state->opts.cachedir) {
+        return loadprecompiled(L, state->opts.cachedir, s);
+    }
     return luaL_loadfile(L, s);
 }
 
@@ -51,260 +330,3237 @@ static inline int loadstring(lua_State *L, const char *s, size_t len,
     return luaL_loadbuffer(L, s, len, name);
 }
 
-static inline int moveit(lua_State *src, lua_State *dst, int idx, int eoi) {
-    size_t len;
+// number of stack slots used by moveit() in addition to the moved values
+#define MOVEIT_NSLOT 10
+
+static inline int hastable(lua_State *L, int idx, int eoi) {
+    for (; idx <= eoi; idx++) {
+        if (lua_type(L, idx) == LUA_TTABLE) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// exchanges short strings through the string cache
+#define STRCACHE_MAXLEN 40
+
+static inline size_t strcache_slot(strcache_t *cache, const char *ptr) {
+    return (((uintptr_t)ptr >> 3) * 2654435761u) & (cache->size - 1);
+}
+
+typedef struct {
+    lua_State *src;
+    lua_State *dst;
+    // index of the seen table in src and the copies table in dst
+    int sidx;
+    int didx;
+    int ntbl;
+    // string cache and the index of its tables in src and dst
+    strcache_t *cache;
+    int csidx;
+    int cdidx;
+    xmetrics_t *mx;
+    // copy the functions and the metatables for L:clone(). the objects of
+    // the ids up to nmerge are the existing tables merged into.
+    int clone;
+    int nmerge;
+} xmove_t;
+
+
+// pushes a cached copy of the string at idx of src onto dst.
+static inline void xstring(xmove_t *m, int idx) {
+    strcache_t *cache = m->cache;
+    size_t len        = 0;
+    const char *s     = lua_tolstring(m->src, idx, &len);
+    size_t slot       = 0;
+
+    if (!cache || len > STRCACHE_MAXLEN) {
+        m->mx->nbyte += len;
+        lua_pushlstring(m->dst, s, len);
+        return;
+    }
+
+    // the cached source strings are anchored in the table at csidx, so the
+    // same address is always the same string.
+    slot = strcache_slot(cache, s);
+    if (cache->ptrs[slot] == s) {
+        cache->hits++;
+        lua_rawgeti(m->dst, m->cdidx, (int)slot + 1);
+        return;
+    }
+
+    // replace the entry
+    cache->misses++;
+    m->mx->nbyte += len;
+    cache->ptrs[slot] = s;
+    lua_pushvalue(m->src, idx);
+    lua_rawseti(m->src, m->csidx, (int)slot + 1);
+    lua_pushlstring(m->dst, s, len);
+    lua_pushvalue(m->dst, -1);
+    lua_rawseti(m->dst, m->cdidx, (int)slot + 1);
+}
+
+// pushes a new reference to the shared object at idx of src onto dst.
+// returns 0 on success, or LUA_TUSERDATA if it is not a shared object.
+static inline int xudata(xmove_t *m, int idx) {
+    void *p = NULL;
+
+    if ((p = testudata(m->src, idx, BUFFER_MT))) {
+        newstate_buffer_push(m->dst, *(newstate_buffer_t **)p);
+        return 0;
+    } else if ((p = testudata(m->src, idx, CHANNEL_MT))) {
+        newstate_channel_push(m->dst, *(newstate_channel_t **)p);
+        return 0;
+    } else if ((p = testudata(m->src, idx, ARRAY_MT))) {
+        newstate_array_push(m->dst, *(newstate_array_t **)p);
+        return 0;
+    } else if ((p = testudata(m->src, idx, SHARED_MT))) {
+        newstate_shared_push(m->dst, (newstate_shared_ref_t *)p);
+        return 0;
+    }
+    return LUA_TUSERDATA;
+}
+
+// pushes the copy of the table or the function at idx of src onto dst if it
+// has been seen. returns its id, or 0 if it has not been seen.
+static inline int xseen(xmove_t *m, int idx) {
+    int id = 0;
+
+    lua_pushvalue(m->src, idx);
+    lua_rawget(m->src, m->sidx);
+    id = (int)lua_tointeger(m->src, -1);
+    lua_pop(m->src, 1);
+    if (id) {
+        lua_rawgeti(m->dst, m->didx, id);
+    }
+    return id;
+}
+
+// registers the value at idx of src and its copy on the top of dst with a
+// new id. its contents are copied later by xcontents().
+static inline void xregister(xmove_t *m, int idx) {
+    const int id = ++m->ntbl;
+
+    // seen[v] = id, seen[id] = v
+    lua_pushvalue(m->src, idx);
+    lua_pushinteger(m->src, id);
+    lua_rawset(m->src, m->sidx);
+    lua_pushvalue(m->src, idx);
+    lua_rawseti(m->src, m->sidx, id);
+    // copies[id] = copy
+    lua_pushvalue(m->dst, -1);
+    lua_rawseti(m->dst, m->didx, id);
+}
+
+static int dumpwriter(lua_State *L, const void *p, size_t sz, void *ud) {
+    (void)L;
+    luaL_addlstring((luaL_Buffer *)ud, (const char *)p, sz);
+    return 0;
+}
+
+// pushes a copy of the function at idx of src onto dst. the C function that
+// has no upvalues is copied by its address, and the Lua function is copied
+// through its bytecode. the upvalues are copied later by xcontents().
+// returns 0 on success, -1 on memory allocation error, or LUA_TFUNCTION if
+// it cannot be copied.
+static int xfunction(xmove_t *m, int idx) {
+    lua_State *src = m->src;
+    lua_State *dst = m->dst;
+    luaL_Buffer b;
+    size_t len     = 0;
+    const char *s  = NULL;
+    int rc         = 0;
+
+    if (xseen(m, idx)) {
+        return 0;
+    } else if (lua_iscfunction(src, idx)) {
+        if (lua_getupvalue(src, idx, 1)) {
+            lua_pop(src, 1);
+            return LUA_TFUNCTION;
+        }
+        lua_pushcfunction(dst, lua_tocfunction(src, idx));
+        return 0;
+    }
+
+    lua_pushvalue(src, idx);
+    luaL_buffinit(dst, &b);
+#if LUA_VERSION_NUM >= 503
+    rc = lua_dump(src, dumpwriter, &b, 0);
+#else
+    rc = lua_dump(src, dumpwriter, &b);
+#endif
+    lua_pop(src, 1);
+    luaL_pushresult(&b);
+    s = lua_tolstring(dst, -1, &len);
+    if (rc || luaL_loadbuffer(dst, s, len, "=clone") != 0) {
+        lua_pop(dst, 2);
+        return -1;
+    }
+    lua_remove(dst, -2);
+    xregister(m, idx);
+    return 0;
+}
+
+static inline void xnumber(lua_State *src, lua_State *dst, int idx) {
+#if LUA_VERSION_NUM >= 503
+    if (lua_isinteger(src, idx)) {
+        lua_pushinteger(dst, lua_tointeger(src, idx));
+        return;
+    }
+#endif
+    lua_pushnumber(dst, lua_tonumber(src, idx));
+}
+
+// pushes a copy of the value at idx of src onto dst. a table that has not
+// been seen yet is registered in the seen table and in the copies table with
+// a new id, and an empty destination table is pushed; its contents are copied
+// later by moveit().
+// returns 0 on success, or the type of a value that cannot be exchanged.
+static inline int xvalue(xmove_t *m, int idx) {
+    lua_State *src = m->src;
+    lua_State *dst = m->dst;
+    const int t    = lua_type(src, idx);
+    int narr       = 0;
+    int nrec       = 0;
+    int exact      = 0;
+
+    m->mx->nvalue++;
+    switch (t) {
+    case LUA_TNIL:
+        lua_pushnil(dst);
+        return 0;
+
+    case LUA_TBOOLEAN:
+        lua_pushboolean(dst, lua_toboolean(src, idx));
+        return 0;
+
+    case LUA_TLIGHTUSERDATA:
+        lua_pushlightuserdata(dst, lua_touserdata(src, idx));
+        return 0;
+
+    case LUA_TNUMBER:
+        xnumber(src, dst, idx);
+        return 0;
+
+    case LUA_TSTRING:
+        xstring(m, idx);
+        return 0;
+
+    case LUA_TTABLE:
+        if (xseen(m, idx)) {
+            return 0;
+        }
+        exact = tblhint(src, idx, &narr, &nrec);
+        lua_createtable(dst, narr, nrec);
+        xregister(m, idx);
+        if (exact && !nrec) {
+            // seen[-id] = true marks the table that is known to have only
+            // the sequence part, so that xfields() can skip the scan of the
+            // other fields.
+            lua_pushboolean(src, 1);
+            lua_rawseti(src, m->sidx, -m->ntbl);
+        }
+        return 0;
+
+    case LUA_TUSERDATA:
+        return xudata(m, idx);
+
+    case LUA_TFUNCTION:
+        if (m->clone) {
+            return xfunction(m, idx);
+        }
+        return t;
+
+    // case LUA_TTHREAD:
+    default:
+        return t;
+    }
+}
+
+// copies the fields other than the sequence part of narr elements of the
+// table at tidx of src into the table on the top of dst. if merge is not 0,
+// the fields that exist in dst are not overwritten.
+static int xrecords(xmove_t *m, int tidx, int narr, int merge) {
+    lua_State *src = m->src;
+    lua_State *dst = m->dst;
+    int rc         = 0;
+
+    lua_pushnil(src);
+    while (lua_next(src, tidx) != 0) {
+        if (isarraykey(src, tidx + 1, narr)) {
+            lua_pop(src, 1);
+            continue;
+        } else if ((rc = xvalue(m, tidx + 1))) {
+            return rc;
+        } else if (merge) {
+            lua_pushvalue(dst, -1);
+            lua_rawget(dst, -3);
+            if (!lua_isnil(dst, -1)) {
+                lua_pop(dst, 2);
+                lua_pop(src, 1);
+                continue;
+            }
+            lua_pop(dst, 1);
+        }
+        if ((rc = xvalue(m, tidx + 2))) {
+            return rc;
+        }
+        lua_rawset(dst, -3);
+        lua_pop(src, 1);
+    }
+    return 0;
+}
+
+// copies the fields of the table at tidx of src into the table on the top of
+// dst. if merge is not 0, the fields that exist in dst are not overwritten.
+// if seq is not 0, the table has only the sequence part.
+static int xfields(xmove_t *m, int tidx, int merge, int seq) {
+    lua_State *src = m->src;
+    lua_State *dst = m->dst;
+    int narr       = merge ? 0 : (int)tbllen(src, tidx);
+    int i          = 1;
+    int rc         = 0;
+
+    // sequence part. the numbers that make up the large arrays are copied
+    // without the dispatch of xvalue().
+    for (; i <= narr; i++) {
+        lua_rawgeti(src, tidx, i);
+        if (lua_type(src, -1) == LUA_TNUMBER) {
+            m->mx->nvalue++;
+            xnumber(src, dst, -1);
+            lua_rawseti(dst, -2, i);
+        } else if (!lua_isnil(src, -1)) {
+            if ((rc = xvalue(m, tidx + 1))) {
+                return rc;
+            }
+            lua_rawseti(dst, -2, i);
+        }
+        lua_pop(src, 1);
+    }
+    if (!seq && (rc = xrecords(m, tidx, narr, merge))) {
+        return rc;
+    }
+
+    if (m->clone && lua_getmetatable(src, tidx)) {
+        if (merge && lua_getmetatable(dst, -1)) {
+            lua_pop(dst, 1);
+        } else if ((rc = xvalue(m, tidx + 1))) {
+            return rc;
+        } else {
+            lua_setmetatable(dst, -2);
+        }
+        lua_pop(src, 1);
+    }
+    return 0;
+}
+
+// copies the upvalues of the function at fidx of src into the function of the
+// id on the top of dst.
+static int xupvalues(xmove_t *m, int fidx, int id) {
+    lua_State *src = m->src;
+    lua_State *dst = m->dst;
+    int i          = 1;
+    int rc         = 0;
+
+    for (; lua_getupvalue(src, fidx, i); i++) {
+#if LUA_VERSION_NUM >= 502
+        // the upvalue shared with the function copied before is joined to
+        // its upvalue. seen[upvalueid] = id * 256 + n
+        void *uid = lua_upvalueid(src, fidx, i);
+
+        lua_pushlightuserdata(src, uid);
+        lua_rawget(src, m->sidx);
+        if (lua_isnumber(src, -1)) {
+            lua_Integer ref = lua_tointeger(src, -1);
+
+            lua_rawgeti(dst, m->didx, (int)(ref / 256));
+            lua_upvaluejoin(dst, -2, i, -1, (int)(ref % 256));
+            lua_pop(dst, 1);
+            lua_pop(src, 2);
+            continue;
+        }
+        lua_pop(src, 1);
+        lua_pushlightuserdata(src, uid);
+        lua_pushinteger(src, (lua_Integer)id * 256 + i);
+        lua_rawset(src, m->sidx);
+#else
+        (void)id;
+#endif
+        if ((rc = xvalue(m, fidx + 1))) {
+            return rc;
+        }
+        lua_setupvalue(dst, -2, i);
+        lua_pop(src, 1);
+    }
+    return 0;
+}
+
+// copies the contents of the tables and the functions registered by
+// xregister(). the objects found while copying the objects of one level of
+// nesting have the ids after them.
+static int xcontents(xmove_t *m) {
+    lua_State *src = m->src;
+    lua_State *dst = m->dst;
+    const int tidx = m->sidx + 1;
+    int levelend   = m->nmerge;
+    int depth      = 0;
+    int id         = 1;
+    int seq        = 0;
+    int rc         = 0;
+
+    for (; id <= m->ntbl; id++) {
+        if (id > levelend) {
+            depth++;
+            levelend = m->ntbl;
+        }
+
+        lua_rawgeti(src, m->sidx, id);
+        lua_rawgeti(dst, m->didx, id);
+        if (lua_type(src, tidx) == LUA_TFUNCTION) {
+            rc = xupvalues(m, tidx, id);
+        } else {
+            // seen[-id] is set by xvalue()
+            lua_rawgeti(src, m->sidx, -id);
+            seq = lua_toboolean(src, -1);
+            lua_pop(src, 1);
+            rc = xfields(m, tidx, id <= m->nmerge, seq);
+        }
+        if (rc) {
+            return rc;
+        }
+        lua_pop(src, 1);
+        lua_pop(dst, 1);
+    }
+
+    if (depth > m->mx->maxdepth) {
+        m->mx->maxdepth = depth;
+    }
+    return 0;
+}
+
+// copies the values from idx to eoi of src onto the top of dst.
+// the tables are copied iteratively in the order in which they are found,
+// so the depth of nesting does not consume the C stack, and each source
+// table is copied only once even if it is referenced more than once.
+// the string cache is used if cache is not NULL and it is enabled.
+// the exchange cost is added to mx.
+// returns 0 on success, -1 if the stack cannot be grown, or the type of a
+// value that cannot be exchanged. on failure, both stacks are restored.
+static int moveit(lua_State *src, lua_State *dst, int idx, int eoi,
+                  strcache_t *cache, xmetrics_t *mx) {
+    const int stop = lua_gettop(src);
+    const int dtop = lua_gettop(dst);
+    uint64_t start = nanotime();
+    xmove_t m      = {.src = src, .dst = dst, .mx = mx};
+    int naux       = 0;
+    int rc         = 0;
+
+    idx = absindex(src, idx);
+    eoi = absindex(src, eoi);
+    if (idx > eoi) {
+        return 0;
+    } else if (!lua_checkstack(src, MOVEIT_NSLOT) ||
+               !lua_checkstack(dst, eoi - idx + 1 + MOVEIT_NSLOT)) {
+        return -1;
+    }
+
+    if (cache && cache->size) {
+        m.cache = cache;
+        lua_rawgeti(src, LUA_REGISTRYINDEX, cache->ref_src);
+        m.csidx = lua_gettop(src);
+        lua_rawgeti(dst, LUA_REGISTRYINDEX, cache->ref_dst);
+        m.cdidx = lua_gettop(dst);
+        naux++;
+    }
+    if (hastable(src, idx, eoi)) {
+        // create the seen table and the copies table
+        lua_newtable(src);
+        m.sidx = lua_gettop(src);
+        lua_newtable(dst);
+        m.didx = lua_gettop(dst);
+        naux++;
+    }
+
+    for (; idx <= eoi; idx++) {
+        if ((rc = xvalue(&m, idx))) {
+            goto FAIL;
+        }
+    }
+
+    if ((rc = xcontents(&m))) {
+        goto FAIL;
+    }
+
+    lua_settop(src, stop);
+    // remove the auxiliary tables
+    while (naux--) {
+        lua_remove(dst, dtop + 1);
+    }
+    mx->ntbl += (size_t)m.ntbl;
+    mx->ns += nanotime() - start;
+    return 0;
+
+FAIL:
+    lua_settop(src, stop);
+    lua_settop(dst, dtop);
+    mx->ns += nanotime() - start;
+    return rc;
+}
+
+static inline int moveerror(lua_State *L, int rc) {
+    lua_pushboolean(L, 0);
+    if (rc < 0) {
+        lua_pushliteral(L, "not enough memory to exchange values");
+        lua_pushinteger(L, LUA_ERRMEM);
+    } else {
+        lua_pushfstring(L, "cannot exchange <%s> value", lua_typename(L, rc));
+        lua_pushinteger(L, -1);
+    }
+    return 3;
+}
+
+// moves the error object at the top of src onto dst, so the error table
+// raised by the script is passed as it is. if the error object cannot be
+// exchanged, the message of its type is pushed instead.
+static void moveerrobj(lua_State *src, lua_State *dst) {
+    xmetrics_t mx = {0};
+
+    if (moveit(src, dst, -1, -1, NULL, &mx)) {
+        lua_pushfstring(dst, "(error object is a %s value)",
+                        luaL_typename(src, -1));
+    }
+}
+
+typedef int (*movefn)(lua_State *src, lua_State *dst, int idx, int eoi,
+                      strcache_t *cache, xmetrics_t *mx);
+
+// moves the values from idx to eoi of src onto dst through the packed format.
+// the size of the packed data is counted as the bytes copied.
+static int packit(lua_State *src, lua_State *dst, int idx, int eoi,
+                  strcache_t *cache, xmetrics_t *mx) {
+    uint64_t start = nanotime();
+    newstate_pack_t pk;
+    int rc = 0;
+
+    (void)cache;
+    newstate_pack_init(&pk);
+    if (!(rc = newstate_pack(src, idx, eoi, &pk)) &&
+        newstate_unpack(dst, pk.buf, pk.len) < 0) {
+        rc = -1;
+    }
+    if (!rc) {
+        mx->nvalue += (size_t)(absindex(src, eoi) - absindex(src, idx) + 1);
+        mx->nbyte += pk.len;
+    }
+    newstate_pack_free(&pk);
+    mx->ns += nanotime() - start;
+    return rc;
+}
+
+// pushes the result of the function called in dst onto src.
+static inline int resultit(lua_State *src, lua_State *dst, int rc,
+                           movefn mover, xmetrics_t *mx) {
+    int nres = 0;
+
+    if (rc) {
+        lua_pushboolean(src, 0);
+        moveerrobj(dst, src);
+        lua_settop(dst, 0);
+        lua_pushinteger(src, rc);
+        return 3;
+    }
+
+    lua_pushboolean(src, 1);
+    nres = lua_gettop(dst);
+    if (nres) {
+        rc = mover(dst, src, 1, nres, NULL, mx);
+        lua_settop(dst, 0);
+        if (rc) {
+            lua_pop(src, 1);
+            return moveerror(src, rc);
+        }
+    }
+
+    return 1 + nres;
+}
+
+static inline void monotonic(struct timespec *ts) {
+    clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+static inline int haslimit(limit_t *limit) {
+    return limit->timeout > 0 || limit->instructions > 0;
+}
+
+static inline int checklimit(limit_t *limit, int count) {
+    if (!limit->exceeded) {
+        if (limit->instructions) {
+            limit->remain -= count;
+            if (limit->remain <= 0) {
+                limit->exceeded = "instruction limit exceeded";
+            }
+        }
+        if (limit->timeout > 0) {
+            struct timespec now;
+
+            monotonic(&now);
+            if (now.tv_sec > limit->deadline.tv_sec ||
+                (now.tv_sec == limit->deadline.tv_sec &&
+                 now.tv_nsec >= limit->deadline.tv_nsec)) {
+                limit->exceeded = "time limit exceeded";
+            }
+        }
+    }
+    return limit->exceeded != NULL;
+}
+
+// dispatches the hook of the child state to the profiler and the execution
+// limits.
+static void hookit(lua_State *L, lua_Debug *ar) {
+    newstate_t *state = getstate(L);
+
+    if (ar->event != LUA_HOOKCOUNT) {
+        newstate_prof_call(L, &state->prof, ar);
+        return;
+    }
+    if (state->prof.mode == PROF_SAMPLE) {
+        newstate_prof_sample(L, &state->prof, state->hookcount);
+    }
+    if (haslimit(&state->limit) &&
+        checklimit(&state->limit, state->hookcount)) {
+        // once exceeded, check on every instruction of the thread so that
+        // the error is raised again right after the script catches it
+        if (lua_gethookcount(L) != 1) {
+            state->hookcount = 1;
+            lua_sethook(L, hookit, lua_gethookmask(L) | LUA_MASKCOUNT, 1);
+        }
+        luaL_error(L, "%s", state->limit.exceeded);
+    }
+}
+
+// installs the hook of the execution limits and the profiler into L that is
+// the child state or its thread. returns 1 if installed.
+static inline int hookbegin(newstate_t *state, lua_State *L) {
+    limit_t *limit = &state->limit;
+    int mask       = 0;
+    int count      = 0;
+
+    limit->exceeded = NULL;
+    if (haslimit(limit)) {
+        limit->remain = limit->instructions;
+        if (limit->timeout > 0) {
+            time_t sec = (time_t)limit->timeout;
+
+            monotonic(&limit->deadline);
+            limit->deadline.tv_sec += sec;
+            limit->deadline.tv_nsec += (long)((limit->timeout - sec) * 1e9);
+            if (limit->deadline.tv_nsec >= 1000000000) {
+                limit->deadline.tv_sec++;
+                limit->deadline.tv_nsec -= 1000000000;
+            }
+        }
+        mask  = LUA_MASKCOUNT;
+        count = limit->interval;
+    }
+    switch (state->prof.mode) {
+    case PROF_SAMPLE:
+        // share the count hook with the smaller interval
+        if (!count || state->prof.interval < count) {
+            count = state->prof.interval;
+        }
+        mask |= LUA_MASKCOUNT;
+        break;
+    case PROF_COUNT:
+        mask |= LUA_MASKCALL | LUA_MASKRET;
+        break;
+    }
+
+    if (!mask) {
+        return 0;
+    }
+    state->hookcount = count;
+    lua_sethook(L, hookit, mask, count);
+    return 1;
+}
+
+// removes the hook installed by hookbegin, and returns ERRLIMIT instead of
+// rc if the call failed by exceeding the limits.
+static inline int hookend(newstate_t *state, lua_State *L, int hook, int rc) {
+    if (hook) {
+        lua_sethook(L, NULL, 0, 0);
+        if (state->prof.mode == PROF_COUNT) {
+            newstate_prof_reset(&state->prof);
+        }
+        if (rc && rc != LUA_YIELD && state->limit.exceeded) {
+            return ERRLIMIT;
+        }
+    }
+    return rc;
+}
+
+#if LUA_VERSION_NUM >= 502
+#    define tracebackit(L, msg) luaL_traceback(L, L, msg, 1)
+#else
+// pushes the message followed by the traceback of the stack of L, in the
+// format of luaL_traceback of lua 5.2 or later.
+static void tracebackit(lua_State *L, const char *msg) {
+    const int top = lua_gettop(L);
+    int level     = 1;
+    lua_Debug ar;
+
+    if (msg) {
+        lua_pushfstring(L, "%s\n", msg);
+    }
+    lua_pushliteral(L, "stack traceback:");
+    while (lua_getstack(L, level++, &ar)) {
+        lua_getinfo(L, "Sln", &ar);
+        lua_pushfstring(L, "\n\t%s:", ar.short_src);
+        if (ar.currentline > 0) {
+            lua_pushfstring(L, "%d:", ar.currentline);
+        }
+        if (*ar.namewhat) {
+            lua_pushfstring(L, " in function '%s'", ar.name);
+        } else if (*ar.what == 'm') {
+            lua_pushliteral(L, " in main chunk");
+        } else if (*ar.what == 'C') {
+            lua_pushliteral(L, " ?");
+        } else {
+            lua_pushfstring(L, " in function <%s:%d>", ar.short_src,
+                            ar.linedefined);
+        }
+        lua_concat(L, lua_gettop(L) - top);
+    }
+    lua_concat(L, lua_gettop(L) - top);
+}
+#endif
+
+// message handler of the script enabled by L:settraceback(). the traceback is
+// appended to the error message, or is set to the traceback field of the
+// error table if the field does not exist.
+static int msgh_lua(lua_State *L) {
+    switch (lua_type(L, 1)) {
+    case LUA_TSTRING:
+    case LUA_TNUMBER:
+        tracebackit(L, lua_tostring(L, 1));
+        break;
+    case LUA_TTABLE:
+        lua_pushliteral(L, "traceback");
+        lua_rawget(L, 1);
+        if (lua_isnil(L, -1)) {
+            lua_pushliteral(L, "traceback");
+            tracebackit(L, NULL);
+            lua_rawset(L, 1);
+        }
+        lua_settop(L, 1);
+        break;
+    }
+    return 1;
+}
+
+// calls the function on the stack of the child state with the memory limit
+// and the execution limits.
+static inline int pcallit(newstate_t *state) {
+    lua_State *L   = state->L;
+    int hook       = hookbegin(state, L);
+    uint64_t start = nanotime();
+    int gcrestart  = 0;
+    int msgh       = 0;
+    int rc         = 0;
+
+    if (state->gcpolicy.stop) {
+        // the collector stopped by the caller is kept stopped after the run
+#if defined(LUA_GCISRUNNING)
+        gcrestart = lua_gc(L, LUA_GCISRUNNING, 0);
+#else
+        gcrestart = !state->gcmode.stopped;
+#endif
+        lua_gc(L, LUA_GCSTOP, 0);
+    }
+    if (state->traceback) {
+        // the message handler is placed under the function before the memory
+        // limit is enabled, since it is pushed outside the protected call
+        lua_pushcfunction(L, msgh_lua);
+        lua_insert(L, 1);
+        msgh = 1;
+    }
+    state->alloc.active = 1;
+    rc = lua_pcall(L, lua_gettop(L) - 1 - msgh, LUA_MULTRET, msgh);
+    state->alloc.active = 0;
+    if (msgh) {
+        lua_remove(L, 1);
+    }
+    if (gcrestart) {
+        lua_gc(L, LUA_GCRESTART, 0);
+    }
+    state->metrics.ncall++;
+    state->metrics.ns += nanotime() - start;
+    return hookend(state, L, hook, rc);
+}
+
+// performs the work of the gc policy after the results of the run have been
+// moved out of the child state, and returns nres.
+static inline int gcafter(newstate_t *state, int nres) {
+    gcpolicy_t *policy = &state->gcpolicy;
+
+    policy->nrun++;
+    if (policy->fullevery && policy->nrun % policy->fullevery == 0) {
+        lua_gc(state->L, LUA_GCCOLLECT, 0);
+    } else if (policy->after == GCPOLICY_STEP) {
+        lua_gc(state->L, LUA_GCSTEP, policy->stepkb);
+    } else if (policy->after == GCPOLICY_COLLECT) {
+        lua_gc(state->L, LUA_GCCOLLECT, 0);
+    }
+    return nres;
+}
+
+static inline int runit(lua_State *L, newstate_t *state) {
+    return gcafter(state, resultit(L, state->L, pcallit(state), moveit,
+                                   &state->metrics.out));
+}
+
+// returns the newstate at index 1 that is not released to the pool.
+static inline newstate_t *checkhandle(lua_State *L) {
+    newstate_t *state = luaL_checkudata(L, 1, MODULE_MT);
+
+    if (state->released) {
+        luaL_error(L, "newstate is released");
+    }
+    return state;
+}
+
+static inline newstate_t *checknewstate(lua_State *L) {
+    newstate_t *state = checkhandle(L);
+
+    if (state->thread) {
+        luaL_error(L, "newstate is running in the thread");
+    } else if (state->busy) {
+        luaL_error(L, "newstate is loading the script");
+    }
+    return state;
+}
+
+static int run_lua(lua_State *L) {
+    newstate_t *state = checknewstate(L);
+    int rc            = 0;
+
+    lua_settop(state->L, 0);
+    lua_rawgeti(state->L, LUA_REGISTRYINDEX, state->ref_fn);
+    if ((rc = moveit(L, state->L, 2, lua_gettop(L), &state->strcache,
+                     &state->metrics.in))) {
+        lua_settop(state->L, 0);
+        return moveerror(L, rc);
+    }
+
+    return runit(L, state);
+}
+
+static int run_packed_lua(lua_State *L) {
+    newstate_t *state = checknewstate(L);
+    int rc            = 0;
+
+    lua_settop(state->L, 0);
+    lua_rawgeti(state->L, LUA_REGISTRYINDEX, state->ref_fn);
+    if ((rc = packit(L, state->L, 2, lua_gettop(L), NULL,
+                     &state->metrics.in))) {
+        lua_settop(state->L, 0);
+        return moveerror(L, rc);
+    }
+
+    return gcafter(state, resultit(L, state->L, pcallit(state), packit,
+                                   &state->metrics.out));
+}
+
+// calls the function with the elements of the table at tidx of L as the
+// arguments, and pushes the results onto L.
+static int runeach(lua_State *L, newstate_t *state, int tidx) {
+    const int top = lua_gettop(L);
+    int narg      = 0;
+    int rc        = 0;
+    int i         = 1;
+
+    if (!lua_istable(L, tidx)) {
+        lua_pushboolean(L, 0);
+        lua_pushfstring(L, "arguments must be table, got <%s>",
+                        luaL_typename(L, tidx));
+        lua_pushinteger(L, -1);
+        return 3;
+    }
+
+    narg = (int)tbllen(L, tidx);
+    luaL_checkstack(L, narg, "too many arguments");
+    for (; i <= narg; i++) {
+        lua_rawgeti(L, tidx, i);
+    }
+
+    lua_settop(state->L, 0);
+    lua_rawgeti(state->L, LUA_REGISTRYINDEX, state->ref_fn);
+    rc = narg ? moveit(L, state->L, top + 1, top + narg, &state->strcache,
+                       &state->metrics.in)
+              : 0;
+    lua_settop(L, top);
+    if (rc) {
+        lua_settop(state->L, 0);
+        return moveerror(L, rc);
+    }
+    return runit(L, state);
+}
+
+// packs the n values on the top of L into a table with the field n.
+static inline void packresult(lua_State *L, int n) {
+    int i = n;
+
+    lua_createtable(L, n, 1);
+    lua_insert(L, -(n + 1));
+    for (; i > 0; i--) {
+        lua_rawseti(L, -(i + 1), i);
+    }
+    lua_pushinteger(L, n);
+    lua_setfield(L, -2, "n");
+}
+
+static int runmany_lua(lua_State *L) {
+    newstate_t *state = checknewstate(L);
+    int n             = 0;
+    int i             = 1;
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 2);
+    n = (int)tbllen(L, 2);
+    lua_createtable(L, n, 0);
+    for (; i <= n; i++) {
+        lua_rawgeti(L, 2, i);
+        packresult(L, runeach(L, state, 4));
+        lua_rawseti(L, 3, i);
+        lua_pop(L, 1);
+    }
+    return 1;
+}
+
+static int irunmany_next(lua_State *L) {
+    newstate_t *state = checknewstate(L);
+    lua_Integer i     = luaL_checkinteger(L, 2) + 1;
+    int nres          = 0;
+
+    lua_settop(L, 0);
+    lua_rawgeti(L, lua_upvalueindex(1), i);
+    if (lua_isnil(L, 1)) {
+        return 0;
+    }
+    lua_pushinteger(L, i);
+    nres = runeach(L, state, 1);
+    lua_remove(L, 1);
+    return 1 + nres;
+}
+
+static int irunmany_lua(lua_State *L) {
+    checknewstate(L);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 2);
+    lua_pushcclosure(L, irunmany_next, 1);
+    lua_pushvalue(L, 1);
+    lua_pushinteger(L, 0);
+    return 3;
+}
+
+// releases the reference of the child state, or defers it while the child
+// state is used by the thread or L:load().
+static void unrefit(newstate_t *state, int ref) {
+    if (ref == LUA_NOREF || ref == LUA_REFNIL) {
+        return;
+    } else if (!state->thread && !state->busy) {
+        luaL_unref(state->L, LUA_REGISTRYINDEX, ref);
+        return;
+    }
+
+    if (state->nunref == state->capunref) {
+        int cap = state->capunref ? state->capunref * 2 : 8;
+        int *p  = realloc(state->unrefs, sizeof(int) * (size_t)cap);
+
+        if (!p) {
+            // the reference is released by lua_close()
+            return;
+        }
+        state->unrefs   = p;
+        state->capunref = cap;
+    }
+    state->unrefs[state->nunref++] = ref;
+}
+
+// releases the references deferred by unrefit().
+static void flushunrefs(newstate_t *state) {
+    int i = 0;
+
+    for (; i < state->nunref; i++) {
+        luaL_unref(state->L, LUA_REGISTRYINDEX, state->unrefs[i]);
+    }
+    state->nunref = 0;
+}
+
+static void *spawnit(void *arg) {
+    newstate_t *state = (newstate_t *)arg;
+
+    state->rc = pcallit(state);
+    __atomic_store_n(&state->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static int spawn_lua(lua_State *L) {
+    newstate_t *state = checknewstate(L);
+    int rc            = 0;
+
+    lua_settop(state->L, 0);
+    lua_rawgeti(state->L, LUA_REGISTRYINDEX, state->ref_fn);
+    if ((rc = moveit(L, state->L, 2, lua_gettop(L), &state->strcache,
+                     &state->metrics.in))) {
+        lua_settop(state->L, 0);
+        return moveerror(L, rc);
+    }
+
+    state->done = 0;
+    if ((rc = pthread_create(&state->tid, NULL, spawnit, state))) {
+        lua_settop(state->L, 0);
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, strerror(rc));
+        lua_pushinteger(L, LUA_ERRRUN);
+        return 3;
+    }
+    state->thread = 1;
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static inline int joinit(lua_State *L, newstate_t *state) {
+    pthread_join(state->tid, NULL);
+    state->thread = 0;
+    flushunrefs(state);
+    return gcafter(state, resultit(L, state->L, state->rc, moveit,
+                                   &state->metrics.out));
+}
+
+static int join_lua(lua_State *L) {
+    newstate_t *state = checkhandle(L);
+
+    if (!state->thread) {
+        return luaL_error(L, "newstate is not spawned");
+    }
+    return joinit(L, state);
+}
+
+static int poll_lua(lua_State *L) {
+    newstate_t *state = checkhandle(L);
+
+    if (!state->thread) {
+        return luaL_error(L, "newstate is not spawned");
+    } else if (!__atomic_load_n(&state->done, __ATOMIC_ACQUIRE)) {
+        lua_pushnil(L);
+        return 1;
+    }
+    return joinit(L, state);
+}
+
+typedef int (*loadfn)(lua_State *L, const char *src, size_t len,
+                      const char *name);
+
+typedef struct {
+    loadfn fn;
+    const char *s;
+    size_t len;
+} loadarg_t;
+
+// calls the loadfn in the protected call, since the loaders allocate the
+// chunkname and the cache path outside of lua_load. returns the function or
+// the error message, and the return code of the loadfn.
+static int loadcall_lua(lua_State *L) {
+    loadarg_t *arg = (loadarg_t *)lua_touserdata(L, 1);
+
+    lua_pushinteger(L, arg->fn(L, arg->s, arg->len, arg->s));
+    return 2;
+}
+
+static inline int loadit(lua_State *L, newstate_t *state, int idx, loadfn fn) {
+    lua_State *dst = state->L;
+    loadarg_t arg  = {.fn = fn};
+    int rc         = 0;
+
+    arg.s = luaL_checklstring(L, idx, &arg.len);
+    lua_settop(dst, 0);
+    lua_pushcfunction(dst, loadcall_lua);
+    lua_pushlightuserdata(dst, &arg);
+    state->alloc.active = 1;
+    rc                  = lua_pcall(dst, 1, 2, 0);
+    state->alloc.active = 0;
+    if (!rc) {
+        rc = (int)lua_tointeger(dst, -1);
+        lua_pop(dst, 1);
+    }
+    if (rc) {
+        lua_pushboolean(L, 0);
+        moveerrobj(dst, L);
+        lua_settop(dst, 0);
+        lua_pushinteger(L, rc);
+        return 3;
+    }
+
+    return 0;
+}
+
+// pushes the table of the named functions of the child state.
+static inline void pushfns(newstate_t *state) {
+    lua_State *L = state->L;
+
+    if (state->ref_fns == LUA_NOREF) {
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        state->ref_fns = luaL_ref(L, LUA_REGISTRYINDEX);
+        return;
+    }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, state->ref_fns);
+}
+
+// maintains the function loaded onto the child state as the preloaded
+// script, or as the named function if name is not NULL.
+static inline int storeit(lua_State *L, newstate_t *state, const char *name,
+                          size_t len) {
+    if (name) {
+        // fns[name] = func
+        pushfns(state);
+        lua_pushlstring(state->L, name, len);
+        lua_pushvalue(state->L, 1);
+        lua_rawset(state->L, -3);
+        lua_settop(state->L, 0);
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+    // unref old func
+    luaL_unref(state->L, LUA_REGISTRYINDEX, state->ref_fn);
+    // maintain new func
+    state->ref_fn = luaL_ref(state->L, LUA_REGISTRYINDEX);
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static inline int load_lua(lua_State *L, loadfn fn) {
+    newstate_t *state = checknewstate(L);
+    size_t len        = 0;
+    const char *name  = luaL_optlstring(L, 3, NULL, &len);
+    int rc            = loadit(L, state, 2, fn);
+
+    if (rc) {
+        lua_settop(state->L, 0);
+        return rc;
+    }
+    return storeit(L, state, name, len);
+}
+
+typedef struct {
+    lua_State *L;
+    // index of the source in L, the slot to keep the current piece and the
+    // index of readcall_lua()
+    int idx;
+    int sidx;
+    int cidx;
+    // source is the function if fp is NULL and fd is -1
+    FILE *fp;
+    int fd;
+    // status of the source. the error message of the function is kept in
+    // the slot, and errno of the read error in err
+    int rc;
+    int err;
+    int eof;
+    char buf[LUAL_BUFFERSIZE];
+} xreader_t;
+
+// calls the reader function, and returns the piece or nil.
+static int readcall_lua(lua_State *L) {
+    lua_call(L, 0, 1);
+    if (!lua_isnil(L, -1) && lua_type(L, -1) != LUA_TSTRING) {
+        return luaL_error(L, "reader function must return a string, got <%s>",
+                          luaL_typename(L, -1));
+    }
+    return 1;
+}
+
+// reads the next piece of the chunk from the source in the parent state.
+// it is called while the child state is loading the chunk, so nothing is
+// allocated in the parent state outside of the protected calls.
+static const char *readit(lua_State *child, void *ud, size_t *sz) {
+    xreader_t *r = (xreader_t *)ud;
+    lua_State *L = r->L;
+
+    (void)child;
+    *sz = 0;
+    if (r->eof) {
+        return NULL;
+    } else if (r->fp) {
+        if (!(*sz = fread(r->buf, 1, sizeof(r->buf), r->fp))) {
+            r->eof = 1;
+            if (ferror(r->fp)) {
+                r->rc  = LUA_ERRFILE;
+                r->err = errno;
+            }
+            return NULL;
+        }
+        return r->buf;
+    } else if (r->fd != -1) {
+        ssize_t n = 0;
+
+        while ((n = read(r->fd, r->buf, sizeof(r->buf))) == -1 &&
+               errno == EINTR) {
+        }
+        if (n <= 0) {
+            r->eof = 1;
+            if (n < 0) {
+                r->rc  = LUA_ERRFILE;
+                r->err = errno;
+            }
+            return NULL;
+        }
+        *sz = (size_t)n;
+        return r->buf;
+    }
+
+    // call the function in protected mode, so that the error is reported
+    // after the child state finishes loading. loadreader_lua() uses only
+    // a few of the LUA_MINSTACK slots, so the values can be pushed.
+    lua_pushvalue(L, r->cidx);
+    lua_pushvalue(L, r->idx);
+    if (lua_pcall(L, 1, 1, 0) != 0) {
+        r->eof = 1;
+        r->rc  = LUA_ERRRUN;
+        lua_replace(L, r->sidx);
+        return NULL;
+    } else if (lua_isnil(L, -1)) {
+        r->eof = 1;
+        lua_pop(L, 1);
+        return NULL;
+    }
+    // keep the piece until the next call
+    lua_replace(L, r->sidx);
+    return lua_tolstring(L, r->sidx, sz);
+}
+
+static int loadreader_lua(lua_State *L) {
+    newstate_t *state     = checknewstate(L);
+    size_t len            = 0;
+    const char *name      = luaL_optlstring(L, 3, NULL, &len);
+    const char *chunkname = luaL_optstring(L, 4, "=load");
+    xreader_t *r          = NULL;
+    void *p               = NULL;
+    int rc                = 0;
+
+    lua_settop(L, 4);
+    r  = lua_newuserdata(L, sizeof(xreader_t));
+    *r = (xreader_t){.L = L, .idx = 2, .fd = -1};
+    lua_pushnil(L);
+    r->sidx = lua_gettop(L);
+    lua_pushcfunction(L, readcall_lua);
+    r->cidx = lua_gettop(L);
+
+    switch (lua_type(L, 2)) {
+    case LUA_TFUNCTION:
+        break;
+    case LUA_TNUMBER:
+        r->fd = (int)lua_tointeger(L, 2);
+        break;
+    default:
+        if ((p = testudata(L, 2, LUA_FILEHANDLE))) {
+            // both luaL_Stream and the handle of Lua 5.1 begin with FILE *
+            if (!(r->fp = *(FILE **)p)) {
+                return luaL_argerror(L, 2, "attempt to use a closed file");
+            }
+            break;
+        }
+        return luaL_argerror(L, 2,
+                             "function, file descriptor or file expected");
+    }
+
+    lua_settop(state->L, 0);
+    // the reader function must not re-enter the newstate during the load
+    state->busy         = 1;
+    state->alloc.active = 1;
+    rc                  = loadreader(state->L, readit, r, chunkname);
+    state->alloc.active = 0;
+    state->busy         = 0;
+    flushunrefs(state);
+    if (r->rc) {
+        // error of the source
+        lua_settop(state->L, 0);
+        if (r->rc == LUA_ERRFILE) {
+            lua_pushfstring(L, "cannot read: %s", strerror(r->err));
+            lua_replace(L, r->sidx);
+        }
+        lua_pushboolean(L, 0);
+        lua_pushvalue(L, r->sidx);
+        lua_pushinteger(L, r->rc);
+        return 3;
+    } else if (rc) {
+        lua_pushboolean(L, 0);
+        moveerrobj(state->L, L);
+        lua_pushinteger(L, rc);
+        lua_settop(state->L, 0);
+        return 3;
+    }
+    return storeit(L, state, name, len);
+}
+
+// pushes the named function onto the child state. returns the number of
+// the values pushed onto L if the function is not found.
+static inline int pushnamedfn(lua_State *L, newstate_t *state, int idx) {
+    size_t len       = 0;
+    const char *name = luaL_checklstring(L, idx, &len);
+
+    lua_settop(state->L, 0);
+    if (state->ref_fns != LUA_NOREF) {
+        lua_rawgeti(state->L, LUA_REGISTRYINDEX, state->ref_fns);
+        lua_pushlstring(state->L, name, len);
+        lua_rawget(state->L, 1);
+        lua_remove(state->L, 1);
+        if (lua_isfunction(state->L, 1)) {
+            return 0;
+        }
+        lua_settop(state->L, 0);
+    }
+
+    lua_pushboolean(L, 0);
+    lua_pushfstring(L, "function %s is not loaded", name);
+    lua_pushinteger(L, LUA_ERRRUN);
+    return 3;
+}
+
+static int call_lua(lua_State *L) {
+    newstate_t *state = checknewstate(L);
+    int rc            = 0;
+
+    if ((rc = pushnamedfn(L, state, 2))) {
+        return rc;
+    } else if ((rc = moveit(L, state->L, 3, lua_gettop(L),
+                            &state->strcache, &state->metrics.in))) {
+        lua_settop(state->L, 0);
+        return moveerror(L, rc);
+    }
+
+    return runit(L, state);
+}
+
+#define COROUTINE_MT "newstate.coroutine"
+
+typedef struct {
+    newstate_t *state;
+    // reference to the newstate in the parent state
+    int ref;
+    // thread of the child state and its reference in the child state
+    lua_State *co;
+    int ref_co;
+    int dead;
+} newstate_co_t;
+
+static inline int resumeit(lua_State *co, lua_State *from, int narg,
+                           int *nres) {
+#if LUA_VERSION_NUM >= 504
+    return lua_resume(co, from, narg, nres);
+#else
+    int rc = 0;
+#    if LUA_VERSION_NUM >= 502
+    rc = lua_resume(co, from, narg);
+#    else
+    (void)from;
+    rc = lua_resume(co, narg);
+#    endif
+    *nres = lua_gettop(co);
+    return rc;
+#endif
+}
+
+// resumes the coroutine with the narg values on the top of its stack, and
+// pushes the results onto L like co:resume().
+static int resumeco(lua_State *L, newstate_co_t *h, int narg) {
+    newstate_t *state = h->state;
+    lua_State *co     = h->co;
+    int nres          = 0;
+    int hook          = 0;
+    uint64_t start    = 0;
+    int rc            = 0;
+
+    hook                = hookbegin(state, co);
+    start               = nanotime();
+    state->alloc.active = 1;
+    rc                  = resumeit(co, state->L, narg, &nres);
+    state->alloc.active = 0;
+    state->metrics.ncall++;
+    state->metrics.ns += nanotime() - start;
+    rc = hookend(state, co, hook, rc);
+
+    if (rc != 0 && rc != LUA_YIELD) {
+        h->dead = 1;
+        lua_pushboolean(L, 0);
+        moveerrobj(co, L);
+        lua_pushinteger(L, rc);
+        return 3;
+    } else if (rc == 0) {
+        h->dead = 1;
+    }
+
+    lua_pushboolean(L, 1);
+    if (nres) {
+        const int top = lua_gettop(co);
+        rc            = moveit(co, L, top - nres + 1, top, NULL,
+                               &state->metrics.out);
+        lua_settop(co, top - nres);
+        if (rc) {
+            h->dead = 1;
+            lua_pop(L, 1);
+            return moveerror(L, rc);
+        }
+    }
+    return 1 + nres;
+}
+
+static int co_resume_lua(lua_State *L) {
+    newstate_co_t *h  = luaL_checkudata(L, 1, COROUTINE_MT);
+    newstate_t *state = h->state;
+    int narg          = lua_gettop(L) - 1;
+    int rc            = 0;
+
+    if (h->dead || !state->L) {
+        lua_pushboolean(L, 0);
+        lua_pushliteral(L, "cannot resume dead coroutine");
+        lua_pushinteger(L, LUA_ERRRUN);
+        return 3;
+    } else if (state->thread) {
+        return luaL_error(L, "newstate is running in the thread");
+    } else if (state->busy) {
+        return luaL_error(L, "newstate is loading the script");
+    } else if (narg &&
+               (rc = moveit(L, h->co, 2, lua_gettop(L), &state->strcache,
+                            &state->metrics.in))) {
+        return moveerror(L, rc);
+    }
+    lua_settop(L, 1);
+    return resumeco(L, h, narg);
+}
+
+static int co_status_lua(lua_State *L) {
+    newstate_co_t *h = luaL_checkudata(L, 1, COROUTINE_MT);
+
+    if (h->dead || !h->state->L) {
+        lua_pushliteral(L, "dead");
+    } else {
+        lua_pushliteral(L, "suspended");
+    }
+    return 1;
+}
+
+static int co_gc__lua(lua_State *L) {
+    newstate_co_t *h  = (newstate_co_t *)lua_touserdata(L, 1);
+    newstate_t *state = h->state;
+
+    if (state) {
+        // the child state may have been moved by the pool
+        while (!state->L && state->moved) {
+            state = (newstate_t *)state->moved;
+        }
+        if (state->L) {
+            // L:spawn() may be running on the child state
+            unrefit(state, h->ref_co);
+        }
+        luaL_unref(L, LUA_REGISTRYINDEX, h->ref);
+        h->state = NULL;
+        h->co    = NULL;
+        h->dead  = 1;
+    }
+    return 0;
+}
+
+static int co_tostring_lua(lua_State *L) {
+    lua_pushfstring(L, COROUTINE_MT ": %p", lua_touserdata(L, 1));
+    return 1;
+}
+
+// pushes the coroutine handle of the function on the stack of the child
+// state onto L. the newstate must be at index 1 of L.
+static newstate_co_t *newco(lua_State *L, newstate_t *state) {
+    newstate_co_t *h = lua_newuserdata(L, sizeof(newstate_co_t));
+
+    *h = (newstate_co_t){
+        .ref    = LUA_NOREF,
+        .ref_co = LUA_NOREF,
+    };
+    luaL_getmetatable(L, COROUTINE_MT);
+    lua_setmetatable(L, -2);
+
+    h->co = lua_newthread(state->L);
+    lua_insert(state->L, 1);
+    lua_xmove(state->L, h->co, 1);
+    h->ref_co = luaL_ref(state->L, LUA_REGISTRYINDEX);
+    lua_pushvalue(L, 1);
+    h->ref   = luaL_ref(L, LUA_REGISTRYINDEX);
+    h->state = state;
+    return h;
+}
+
+static int coroutine_lua(lua_State *L) {
+    newstate_t *state = checknewstate(L);
+    int rc            = 0;
+
+    if (lua_isnoneornil(L, 2)) {
+        lua_settop(state->L, 0);
+        lua_rawgeti(state->L, LUA_REGISTRYINDEX, state->ref_fn);
+    } else if ((rc = pushnamedfn(L, state, 2))) {
+        return rc;
+    }
+    newco(L, state);
+    return 1;
+}
+
+// returns the values of the next yield of the script, or nothing after the
+// script has returned. the arguments of L:stream() are passed on the first
+// call. the error of the script is raised.
+static int stream_next(lua_State *L) {
+    newstate_co_t *h = lua_touserdata(L, lua_upvalueindex(1));
+    int narg         = (int)lua_tointeger(L, lua_upvalueindex(2));
+    int n            = 0;
+
+    lua_settop(L, 0);
+    if (h->dead && h->state && h->state->L) {
+        return 0;
+    } else if (!h->state || !h->state->L) {
+        return luaL_error(L, "cannot resume dead coroutine");
+    } else if (h->state->thread) {
+        return luaL_error(L, "newstate is running in the thread");
+    } else if (h->state->busy) {
+        return luaL_error(L, "newstate is loading the script");
+    } else if (narg) {
+        lua_pushinteger(L, 0);
+        lua_replace(L, lua_upvalueindex(2));
+    }
+
+    n = resumeco(L, h, narg);
+    if (!lua_toboolean(L, 1)) {
+        lua_settop(L, 2);
+        return lua_error(L);
+    }
+    return n - 1;
+}
+
+static int stream_lua(lua_State *L) {
+    newstate_t *state = checknewstate(L);
+    const int narg    = lua_gettop(L) - 1;
+    newstate_co_t *h  = NULL;
+    int rc            = 0;
+
+    lua_settop(state->L, 0);
+    lua_rawgeti(state->L, LUA_REGISTRYINDEX, state->ref_fn);
+    h = newco(L, state);
+    // the arguments wait on the stack of the coroutine until the first call
+    if (narg && (rc = moveit(L, h->co, 2, narg + 1, &state->strcache,
+                             &state->metrics.in))) {
+        return moveerror(L, rc);
+    }
+    lua_pushinteger(L, narg);
+    lua_pushcclosure(L, stream_next, 2);
+    return 1;
+}
+
+static int unload_lua(lua_State *L) {
+    newstate_t *state = checknewstate(L);
+    size_t len        = 0;
+    const char *name  = luaL_checklstring(L, 2, &len);
+
+    if (state->ref_fns != LUA_NOREF) {
+        lua_rawgeti(state->L, LUA_REGISTRYINDEX, state->ref_fns);
+        lua_pushlstring(state->L, name, len);
+        lua_pushnil(state->L);
+        lua_rawset(state->L, -3);
+        lua_pop(state->L, 1);
+    }
+    return 0;
+}
+
+static int loadstring_lua(lua_State *L) {
+    return load_lua(L, loadstring);
+}
+
+static int loadfile_lua(lua_State *L) {
+    return load_lua(L, loadfile);
+}
+
+// FNV-1a
+static inline uint64_t hashit(const char *s, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    while (len--) {
+        h ^= (unsigned char)*s++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static inline void chunkent_unlink(chunkcache_t *cache, size_t i) {
+    chunkent_t *ent = &cache->ents[i - 1];
+
+    if (ent->prev) {
+        cache->ents[ent->prev - 1].next = ent->next;
+    } else {
+        cache->head = ent->next;
+    }
+    if (ent->next) {
+        cache->ents[ent->next - 1].prev = ent->prev;
+    } else {
+        cache->tail = ent->prev;
+    }
+    ent->prev = ent->next = 0;
+}
+
+// moves the entry i to the head of the list as the most recently used one.
+static inline void chunkent_touch(chunkcache_t *cache, size_t i) {
+    chunkent_t *ent = &cache->ents[i - 1];
+
+    if (cache->head == i) {
+        return;
+    } else if (ent->prev || ent->next || cache->tail == i) {
+        chunkent_unlink(cache, i);
+    }
+    ent->next = cache->head;
+    if (cache->head) {
+        cache->ents[cache->head - 1].prev = i;
+    }
+    cache->head = i;
+    if (!cache->tail) {
+        cache->tail = i;
+    }
+}
+
+static inline void pushhashkey(lua_State *L, uint64_t hash) {
+    lua_pushlightuserdata(L, (void *)(uintptr_t)hash);
+}
+
+// loads the function through the chunk cache of the newstate.
+static int loadcached(lua_State *L, newstate_t *state, int idx, loadfn fn) {
+    chunkcache_t *cache = &state->chunkcache;
+    lua_State *dst      = state->L;
+    size_t len          = 0;
+    const char *s       = luaL_checklstring(L, idx, &len);
+    chunkent_t key      = {.len = len, .isfile = (fn == loadfile)};
+    chunkent_t *ent     = NULL;
+    size_t i            = 0;
+    int rc              = 0;
+
+    if (!cache->size) {
+        return loadit(L, state, idx, fn);
+    } else if (key.isfile) {
+        struct stat st;
+
+        if (stat(s, &st) != 0) {
+            // let the loader report the error
+            return loadit(L, state, idx, fn);
+        }
+        key.mtime = mtimeit(&st);
+        key.ino   = st.st_ino;
+        key.fsize = st.st_size;
+    }
+    // the pathname and the same source code are different keys
+    key.hash = hashit(s, len) ^ (uint64_t)key.isfile;
+
+    lua_settop(dst, 0);
+    lua_rawgeti(dst, LUA_REGISTRYINDEX, cache->ref);
+    pushhashkey(dst, key.hash);
+    lua_rawget(dst, 1);
+    i = (size_t)lua_tointeger(dst, -1);
+    lua_pop(dst, 1);
+    if (i) {
+        ent = &cache->ents[i - 1];
+        if (ent->hash == key.hash && ent->len == key.len &&
+            ent->isfile == key.isfile && ent->mtime == key.mtime &&
+            ent->ino == key.ino && ent->fsize == key.fsize) {
+            const char *v = NULL;
+
+            lua_rawgeti(dst, 1, (int)i * 2);
+            v = lua_tostring(dst, -1);
+            lua_pop(dst, 1);
+            if (v && memcmp(v, s, len) == 0) {
+                cache->hits++;
+                chunkent_touch(cache, i);
+                lua_rawgeti(dst, 1, (int)i * 2 - 1);
+                lua_remove(dst, 1);
+                return 0;
+            }
+        }
+    }
+
+    cache->misses++;
+    if ((rc = loadit(L, state, idx, fn))) {
+        return rc;
+    }
+
+    // replace the stale entry of the same hash, use an empty entry, or evict
+    // the least recently used entry
+    lua_rawgeti(dst, LUA_REGISTRYINDEX, cache->ref);
+    if (!i) {
+        if (cache->count < cache->size) {
+            i = ++cache->count;
+        } else {
+            i = cache->tail;
+            pushhashkey(dst, cache->ents[i - 1].hash);
+            lua_pushnil(dst);
+            lua_rawset(dst, -3);
+        }
+        pushhashkey(dst, key.hash);
+        lua_pushinteger(dst, (lua_Integer)i);
+        lua_rawset(dst, -3);
+    }
+    ent       = &cache->ents[i - 1];
+    key.prev  = ent->prev;
+    key.next  = ent->next;
+    *ent      = key;
+    chunkent_touch(cache, i);
+    lua_pushvalue(dst, 1);
+    lua_rawseti(dst, -2, (int)i * 2 - 1);
+    lua_pushlstring(dst, s, len);
+    lua_rawseti(dst, -2, (int)i * 2);
+    lua_pop(dst, 1);
+    return 0;
+}
+
+static inline int do_lua(lua_State *L, loadfn fn) {
+    newstate_t *state = checknewstate(L);
+    int rc = 0;
+
+    if ((rc = loadcached(L, state, 2, fn))) {
+        lua_settop(state->L, 0);
+        return rc;
+    } else if ((rc = moveit(L, state->L, 3, lua_gettop(L), &state->strcache,
+                            &state->metrics.in))) {
+        lua_settop(state->L, 0);
+        return moveerror(L, rc);
+    }
+
+    return runit(L, state);
+}
+
+static int dostring_lua(lua_State *L) {
+    return do_lua(L, loadstring);
+}
+
+static int dofile_lua(lua_State *L) {
+    return do_lua(L, loadfile);
+}
+
+static int gc_lua(lua_State *L) {
+    newstate_t *state = checknewstate(L);
+    int what = (int)luaL_checkinteger(L, 2);
+    int arg = (int)luaL_optinteger(L, 3, 0);
+
+    switch (what) {
+
+#if defined(LUA_GCISRUNNING)
+    case LUA_GCISRUNNING:
+        lua_pushboolean(L, lua_gc(state->L, what, 0));
+        return 1;
+#endif
+
+#if LUA_VERSION_NUM >= 504
+    case LUA_GCINC: {
+        int stepmul  = (int)luaL_optinteger(L, 4, 0);
+        int stepsize = (int)luaL_optinteger(L, 5, 0);
+
+        state->gcmode.mode = GCMODE_INC;
+        if (stepsize) {
+            state->gcmode.stepsize = stepsize;
+        }
+        lua_pushinteger(L, lua_gc(state->L, what, arg, stepmul, stepsize));
+        return 1;
+    }
+
+    case LUA_GCGEN: {
+        int majormul = (int)luaL_optinteger(L, 4, 0);
+
+        state->gcmode.mode = GCMODE_GEN;
+        if (arg) {
+            state->gcmode.minormul = arg;
+        }
+        if (majormul) {
+            state->gcmode.majormul = majormul;
+        }
+        lua_pushinteger(L, lua_gc(state->L, what, arg, majormul));
+        return 1;
+    }
+
+#elif defined(LUA_GCGEN)
+    // the modes of Lua 5.2 have no parameters
+    case LUA_GCINC:
+    case LUA_GCGEN:
+        state->gcmode.mode = what == LUA_GCGEN ? GCMODE_GEN : GCMODE_INC;
+        lua_pushinteger(L, lua_gc(state->L, what, 0));
+        return 1;
+#endif
+
+    case LUA_GCSTOP:
+    case LUA_GCRESTART:
+        state->gcmode.stopped = what == LUA_GCSTOP;
+        lua_pushinteger(L, lua_gc(state->L, what, arg));
+        return 1;
+
+    default:
+        lua_pushinteger(L, lua_gc(state->L, what, arg));
+        return 1;
+    }
+}
+
+static int strcache_lua(lua_State *L) {
+    newstate_t *state = checkhandle(L);
+
+    lua_createtable(L, 0, 3);
+    lua_pushinteger(L, (lua_Integer)state->strcache.size);
+    lua_setfield(L, -2, "size");
+    lua_pushinteger(L, (lua_Integer)state->strcache.hits);
+    lua_setfield(L, -2, "hits");
+    lua_pushinteger(L, (lua_Integer)state->strcache.misses);
+    lua_setfield(L, -2, "misses");
+    return 1;
+}
+
+static int chunkcache_lua(lua_State *L) {
+    newstate_t *state   = checkhandle(L);
+    chunkcache_t *cache = &state->chunkcache;
+    size_t total        = cache->hits + cache->misses;
+
+    lua_createtable(L, 0, 5);
+    lua_pushinteger(L, (lua_Integer)cache->size);
+    lua_setfield(L, -2, "size");
+    lua_pushinteger(L, (lua_Integer)cache->count);
+    lua_setfield(L, -2, "count");
+    lua_pushinteger(L, (lua_Integer)cache->hits);
+    lua_setfield(L, -2, "hits");
+    lua_pushinteger(L, (lua_Integer)cache->misses);
+    lua_setfield(L, -2, "misses");
+    lua_pushnumber(L, total ? (lua_Number)cache->hits / total : 0);
+    lua_setfield(L, -2, "ratio");
+    return 1;
+}
+
+static int stats_lua(lua_State *L) {
+    newstate_t *state   = checknewstate(L);
+    newstate_alloc_t *a = &state->alloc;
+    int i               = 0;
+
+    lua_createtable(L, 0, 9);
+    lua_pushinteger(L, (lua_Integer)a->nalloc);
+    lua_setfield(L, -2, "alloc");
+    lua_pushinteger(L, (lua_Integer)a->nfree);
+    lua_setfield(L, -2, "free");
+    lua_pushinteger(L, (lua_Integer)a->nrealloc);
+    lua_setfield(L, -2, "realloc");
+    lua_pushinteger(L, (lua_Integer)a->nfail);
+    lua_setfield(L, -2, "fail");
+    lua_pushinteger(L, (lua_Integer)a->used);
+    lua_setfield(L, -2, "current");
+    lua_pushinteger(L, (lua_Integer)a->peak);
+    lua_setfield(L, -2, "peak");
+    lua_pushinteger(L, (lua_Integer)a->limit);
+    lua_setfield(L, -2, "limit");
+    // histogram of the allocation sizes keyed by the upper bound
+    lua_createtable(L, 0, ALLOC_NHIST);
+    for (i = 0; i < ALLOC_NHIST; i++) {
+        if (a->hist[i]) {
+            lua_pushinteger(L, (lua_Integer)8 << i);
+            lua_pushinteger(L, (lua_Integer)a->hist[i]);
+            lua_rawset(L, -3);
+        }
+    }
+    lua_setfield(L, -2, "histogram");
+    return 1;
+}
+
+// table of the loaded modules in the registry
+#define LOADED_KEY "_LOADED"
+
+typedef struct {
+    const char *name;
+    // name of the module; NULL if it is a part of the base library
+    const char *modname;
+    lua_CFunction open;
+    // opened immediately even in the lazy mode
+    int eager;
+} libent_t;
+
+static const libent_t LIBS[] = {
+#if LUA_VERSION_NUM >= 502
+    {"base", "_G", luaopen_base, 1},
+    {"coroutine", LUA_COLIBNAME, luaopen_coroutine, 0},
+#else
+    {"base", "", luaopen_base, 1},
+    {"coroutine", NULL, NULL, 0},
+#endif
+    {"package", LUA_LOADLIBNAME, luaopen_package, 1},
+    // string values refer to the string library through their metatable
+    {"string", LUA_STRLIBNAME, luaopen_string, 1},
+    {"table", LUA_TABLIBNAME, luaopen_table, 0},
+    {"math", LUA_MATHLIBNAME, luaopen_math, 0},
+    {"io", LUA_IOLIBNAME, luaopen_io, 0},
+    {"os", LUA_OSLIBNAME, luaopen_os, 0},
+    {"debug", LUA_DBLIBNAME, luaopen_debug, 0},
+#if LUA_VERSION_NUM >= 503
+    {"utf8", LUA_UTF8LIBNAME, luaopen_utf8, 0},
+#elif LUA_VERSION_NUM == 502
+    {"bit32", LUA_BITLIBNAME, luaopen_bit32, 0},
+#endif
+    {NULL, NULL, NULL, 0},
+};
+
+#define LIBS_ALL (~0u)
+
+static void openlib(lua_State *L, const char *modname, lua_CFunction open) {
+#if LUA_VERSION_NUM >= 502
+    luaL_requiref(L, modname, open, 1);
+    lua_pop(L, 1);
+#else
+    lua_pushcfunction(L, open);
+    lua_pushstring(L, modname);
+    lua_call(L, 1, 0);
+#endif
+}
+
+// __index of the global table in the lazy mode. opens the library on the
+// first access to its global variable.
+static int lazylib_lua(lua_State *L) {
+    lua_CFunction open = NULL;
+
+    lua_settop(L, 2);
+    if (lua_type(L, 2) != LUA_TSTRING) {
+        return 0;
+    }
+    lua_pushvalue(L, 2);
+    lua_rawget(L, lua_upvalueindex(1));
+    if (!(open = lua_tocfunction(L, -1))) {
+        return 0;
+    }
+    // the stub is kept so that the library is opened again if the global
+    // variable is removed, e.g. by pool:release().
+    openlib(L, lua_tostring(L, 2), open);
+    lua_settop(L, 2);
+    lua_rawget(L, 1);
+    return 1;
+}
+
+// loader of package.preload in the lazy mode. require() opens the library
+// in the same way as the first access to its global variable, so both get
+// the same table from package.loaded.
+static int lazyrequire_lua(lua_State *L) {
+    const char *modname = luaL_checkstring(L, 1);
+
+    openlib(L, modname, lua_tocfunction(L, lua_upvalueindex(1)));
+    lua_getfield(L, LUA_REGISTRYINDEX, LOADED_KEY);
+    lua_getfield(L, -1, modname);
+    return 1;
+}
+
+// registers the lazy libraries in the table at idx to package.preload.
+static void preloadlibs(lua_State *L, int idx) {
+    idx = absindex(L, idx);
+    lua_getfield(L, LUA_REGISTRYINDEX, LOADED_KEY);
+    lua_getfield(L, -1, LUA_LOADLIBNAME);
+    if (lua_istable(L, -1)) {
+        lua_getfield(L, -1, "preload");
+        if (lua_istable(L, -1)) {
+            lua_pushnil(L);
+            while (lua_next(L, idx) != 0) {
+                lua_pushcclosure(L, lazyrequire_lua, 1);
+                lua_pushvalue(L, -2);
+                lua_insert(L, -2);
+                lua_rawset(L, -4);
+            }
+        }
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 2);
+}
+
+// opens the libraries selected by the bits of libs. if lazy is not 0, the
+// libraries except the eager ones are opened on the first access to their
+// global variables or by require().
+static void openlibs(lua_State *L, unsigned libs, int lazy) {
+    const libent_t *lib = LIBS;
+    unsigned bit        = 1;
+    int nlazy           = 0;
+
+    if (libs == LIBS_ALL && !lazy) {
+        luaL_openlibs(L);
+        return;
+    }
+
+    lua_newtable(L);
+    for (; lib->name; lib++, bit <<= 1) {
+        if (!(libs & bit) || !lib->modname) {
+            continue;
+        } else if (lazy && !lib->eager) {
+            lua_pushcfunction(L, lib->open);
+            lua_setfield(L, -2, lib->modname);
+            nlazy++;
+            continue;
+        }
+        openlib(L, lib->modname, lib->open);
+    }
+
+    if (nlazy) {
+        preloadlibs(L, -1);
+        lua_pushglobaltable(L);
+        lua_createtable(L, 0, 1);
+        lua_pushvalue(L, -3);
+        lua_pushcclosure(L, lazylib_lua, 1);
+        lua_setfield(L, -2, "__index");
+        lua_setmetatable(L, -2);
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+}
+
+// returns the bits of the libraries listed in the table at idx.
+static unsigned checklibs(lua_State *L, int idx) {
+    unsigned libs = 0;
+    int n         = (int)tbllen(L, idx);
+    int i         = 1;
+
+    for (; i <= n; i++) {
+        const libent_t *lib = LIBS;
+        unsigned bit        = 1;
+        const char *name    = NULL;
+
+        lua_rawgeti(L, idx, i);
+        if (!(name = lua_tostring(L, -1))) {
+            luaL_error(L, "opts.libs must be array of strings");
+        }
+        while (lib->name && strcmp(lib->name, name) != 0) {
+            lib++;
+            bit <<= 1;
+        }
+        if (!lib->name) {
+            luaL_error(L, "opts.libs contains unknown library \"%s\"", name);
+        }
+        libs |= bit;
+        lua_pop(L, 1);
+    }
+    return libs;
+}
+
+static inline int optboolean(lua_State *L, int idx, const char *k, int def) {
+    lua_getfield(L, idx, k);
+    switch (lua_type(L, -1)) {
+    case LUA_TNIL:
+        break;
+    case LUA_TBOOLEAN:
+        def = lua_toboolean(L, -1);
+        break;
+    default:
+        return luaL_error(L, "opts.%s must be boolean", k);
+    }
+    lua_pop(L, 1);
+    return def;
+}
+
+static inline lua_Integer optinteger(lua_State *L, int idx, const char *k,
+                                     lua_Integer def) {
+    lua_getfield(L, idx, k);
+    switch (lua_type(L, -1)) {
+    case LUA_TNIL:
+        break;
+    case LUA_TNUMBER:
+        def = lua_tointeger(L, -1);
+        break;
+    default:
+        return luaL_error(L, "opts.%s must be integer", k);
+    }
+    lua_pop(L, 1);
+    return def;
+}
+
+static inline lua_Number optnumber(lua_State *L, int idx, const char *k,
+                                   lua_Number def) {
+    lua_getfield(L, idx, k);
+    switch (lua_type(L, -1)) {
+    case LUA_TNIL:
+        break;
+    case LUA_TNUMBER:
+        def = lua_tonumber(L, -1);
+        break;
+    default:
+        return luaL_error(L, "opts.%s must be number", k);
+    }
+    lua_pop(L, 1);
+    return def;
+}
+
+static void checkopts(lua_State *L, int idx, newstate_opts_t *opts) {
+    lua_Integer memlimit = 0;
+
+    *opts = (newstate_opts_t){
+        .openlibs = 1,
+        .libs     = LIBS_ALL,
+        .strcache = 0,
+    };
+
+    switch (lua_type(L, idx)) {
+    case LUA_TNONE:
+    case LUA_TNIL:
+        return;
+    case LUA_TBOOLEAN:
+        opts->openlibs = lua_toboolean(L, idx);
+        return;
+    default:
+        luaL_checktype(L, idx, LUA_TTABLE);
+        opts->openlibs = optboolean(L, idx, "openlibs", 1);
+        opts->lazy     = optboolean(L, idx, "lazy", 0);
+        lua_getfield(L, idx, "libs");
+        if (!lua_isnil(L, -1)) {
+            luaL_argcheck(L, lua_istable(L, -1), idx,
+                          "opts.libs must be array of strings");
+            opts->openlibs = 1;
+            opts->libs     = checklibs(L, lua_gettop(L));
+        }
+        lua_pop(L, 1);
+        opts->strcache = optinteger(L, idx, "strcache", 0);
+        luaL_argcheck(L, opts->strcache >= 0, idx,
+                      "opts.strcache must be greater than or equal to 0");
+        opts->chunkcache = optinteger(L, idx, "chunkcache", 0);
+        luaL_argcheck(L, opts->chunkcache >= 0, idx,
+                      "opts.chunkcache must be greater than or equal to 0");
+        memlimit = optinteger(L, idx, "memlimit", 0);
+        luaL_argcheck(L, memlimit >= 0, idx,
+                      "opts.memlimit must be greater than or equal to 0");
+        opts->memlimit = (size_t)memlimit;
+        lua_getfield(L, idx, "cachedir");
+        if (!lua_isnil(L, -1)) {
+            size_t len      = 0;
+            const char *dir = NULL;
+
+            luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING, idx,
+                          "opts.cachedir must be string");
+            dir = lua_tolstring(L, -1, &len);
+            luaL_argcheck(L, len > 0 && len < CACHEDIR_MAX, idx,
+                          "opts.cachedir is empty or too long");
+            memcpy(opts->cachedir, dir, len + 1);
+        }
+        lua_pop(L, 1);
+        lua_getfield(L, idx, "allocator");
+        switch (lua_type(L, -1)) {
+        case LUA_TNIL:
+            break;
+        case LUA_TSTRING:
+            if (strcmp(lua_tostring(L, -1), "pool") == 0) {
+                opts->arena = 1;
+                break;
+            } else if (strcmp(lua_tostring(L, -1), "default") == 0) {
+                break;
+            }
+            // fallthrough
+        default:
+            luaL_error(L, "opts.allocator must be \"default\" or \"pool\"");
+        }
+        lua_pop(L, 1);
+    }
+}
+
+static int setlimits_lua(lua_State *L) {
+    newstate_t *state    = checknewstate(L);
+    limit_t limit        = {.interval = LIMIT_INTERVAL};
+    lua_Integer interval = 0;
+
+    if (!lua_isnoneornil(L, 2)) {
+        luaL_checktype(L, 2, LUA_TTABLE);
+        limit.timeout = optnumber(L, 2, "timeout", 0);
+        luaL_argcheck(L, limit.timeout >= 0, 2,
+                      "opts.timeout must be greater than or equal to 0");
+        limit.instructions = optinteger(L, 2, "instructions", 0);
+        luaL_argcheck(L, limit.instructions >= 0, 2,
+                      "opts.instructions must be greater than or equal to 0");
+        interval = optinteger(L, 2, "interval", LIMIT_INTERVAL);
+        luaL_argcheck(L, interval > 0 && interval <= INT_MAX, 2,
+                      "opts.interval must be greater than 0");
+        limit.interval = (int)interval;
+    }
+    state->limit = limit;
+    return 0;
+}
+
+static int setgcpolicy_lua(lua_State *L) {
+    newstate_t *state  = checknewstate(L);
+    gcpolicy_t policy  = {0};
+    lua_Integer stepkb = 0;
+
+    if (!lua_isnoneornil(L, 2)) {
+        luaL_checktype(L, 2, LUA_TTABLE);
+        lua_getfield(L, 2, "after_run");
+        if (!lua_isnil(L, -1)) {
+            const char *after = lua_tostring(L, -1);
+
+            if (lua_type(L, -1) != LUA_TSTRING) {
+                after = NULL;
+            } else if (strcmp(after, "step") == 0) {
+                policy.after = GCPOLICY_STEP;
+            } else if (strcmp(after, "collect") == 0) {
+                policy.after = GCPOLICY_COLLECT;
+            } else if (strcmp(after, "none") != 0) {
+                after = NULL;
+            }
+            luaL_argcheck(L, after != NULL, 2,
+                          "opts.after_run must be \"none\", \"step\" or "
+                          "\"collect\"");
+        }
+        lua_pop(L, 1);
+        stepkb = optinteger(L, 2, "step_kb", 0);
+        luaL_argcheck(L, stepkb >= 0 && stepkb <= INT_MAX, 2,
+                      "opts.step_kb must be greater than or equal to 0");
+        policy.stepkb    = (int)stepkb;
+        policy.fullevery = optinteger(L, 2, "full_every", 0);
+        luaL_argcheck(L, policy.fullevery >= 0, 2,
+                      "opts.full_every must be greater than or equal to 0");
+        policy.stop = optboolean(L, 2, "stop_during_run", 0);
+    }
+    state->gcpolicy = policy;
+    return 0;
+}
+
+static int settraceback_lua(lua_State *L) {
+    newstate_t *state = checknewstate(L);
+
+    state->traceback = lua_toboolean(L, 2);
+    return 0;
+}
+
+// returns the value of the parameter of the collector by setting it and
+// restoring the previous value.
+static inline int gcparam(lua_State *L, int what) {
+    int v = lua_gc(L, what, 0);
+
+    lua_gc(L, what, v);
+    return v;
+}
+
+static inline int optgcparam(lua_State *L, int idx, const char *k) {
+    lua_Integer v = optinteger(L, idx, k, 0);
+
+    if (v < 0 || v > INT_MAX) {
+        return luaL_error(L, "opts.%s must be greater than or equal to 0", k);
+    }
+    return (int)v;
+}
+
+static int gcmode_lua(lua_State *L) {
+    static const char *const modes[] = {"inc", "gen", NULL};
+    newstate_t *state                = checknewstate(L);
+    int mode                         = luaL_checkoption(L, 2, NULL, modes);
+    gcmode_t prev                    = state->gcmode;
+    int pause                        = 0;
+    int stepmul                      = 0;
+    int stepsize                     = 0;
+    int minormul                     = 0;
+    int majormul                     = 0;
+
+#if !defined(LUA_GCGEN)
+    luaL_argcheck(L, mode == GCMODE_INC, 2,
+                  "generational mode is not supported");
+#endif
+    if (!lua_isnoneornil(L, 3)) {
+        luaL_checktype(L, 3, LUA_TTABLE);
+        pause    = optgcparam(L, 3, "pause");
+        stepmul  = optgcparam(L, 3, "stepmul");
+        stepsize = optgcparam(L, 3, "stepsize");
+        minormul = optgcparam(L, 3, "minormul");
+        majormul = optgcparam(L, 3, "majormul");
+    }
+
+    lua_createtable(L, 0, 6);
+    lua_pushinteger(L, gcparam(state->L, LUA_GCSETPAUSE));
+    lua_setfield(L, -2, "pause");
+    lua_pushinteger(L, gcparam(state->L, LUA_GCSETSTEPMUL));
+    lua_setfield(L, -2, "stepmul");
+
+#if LUA_VERSION_NUM >= 504
+    lua_pushinteger(L, prev.stepsize);
+    lua_setfield(L, -2, "stepsize");
+    lua_pushinteger(L, prev.minormul);
+    lua_setfield(L, -2, "minormul");
+    lua_pushinteger(L, prev.majormul);
+    lua_setfield(L, -2, "majormul");
+    // the script may have changed the mode by collectgarbage()
+    if (mode == GCMODE_GEN) {
+        prev.mode = lua_gc(state->L, LUA_GCGEN, minormul, majormul);
+        state->gcmode.minormul = minormul ? minormul : prev.minormul;
+        state->gcmode.majormul = majormul ? majormul : prev.majormul;
+    } else {
+        prev.mode = lua_gc(state->L, LUA_GCINC, pause, stepmul, stepsize);
+        state->gcmode.stepsize = stepsize ? stepsize : prev.stepsize;
+    }
+    prev.mode = prev.mode == LUA_GCGEN ? GCMODE_GEN : GCMODE_INC;
+#else
+    if (pause) {
+        lua_gc(state->L, LUA_GCSETPAUSE, pause);
+    }
+    if (stepmul) {
+        lua_gc(state->L, LUA_GCSETSTEPMUL, stepmul);
+    }
+#    if defined(LUA_GCGEN)
+    lua_gc(state->L, mode == GCMODE_GEN ? LUA_GCGEN : LUA_GCINC, 0);
+#    endif
+    (void)stepsize;
+    (void)minormul;
+    (void)majormul;
+#endif
+    state->gcmode.mode = mode;
+
+    lua_pushstring(L, modes[prev.mode]);
+    lua_setfield(L, -2, "mode");
+    return 1;
+}
+
+static void pushxmetrics(lua_State *L, xmetrics_t *mx) {
+    lua_createtable(L, 0, 5);
+    lua_pushinteger(L, (lua_Integer)mx->nvalue);
+    lua_setfield(L, -2, "values");
+    lua_pushinteger(L, (lua_Integer)mx->nbyte);
+    lua_setfield(L, -2, "bytes");
+    lua_pushinteger(L, (lua_Integer)mx->ntbl);
+    lua_setfield(L, -2, "tables");
+    lua_pushinteger(L, (lua_Integer)mx->maxdepth);
+    lua_setfield(L, -2, "depth");
+    lua_pushnumber(L, (lua_Number)mx->ns / 1e9);
+    lua_setfield(L, -2, "time");
+}
+
+static int metrics_lua(lua_State *L) {
+    newstate_t *state = checknewstate(L);
+    metrics_t *mt     = &state->metrics;
+
+    lua_createtable(L, 0, 4);
+    lua_pushinteger(L, (lua_Integer)mt->ncall);
+    lua_setfield(L, -2, "calls");
+    lua_pushnumber(L, (lua_Number)mt->ns / 1e9);
+    lua_setfield(L, -2, "time");
+    pushxmetrics(L, &mt->in);
+    lua_setfield(L, -2, "input");
+    pushxmetrics(L, &mt->out);
+    lua_setfield(L, -2, "output");
+    if (lua_toboolean(L, 2)) {
+        *mt = (metrics_t){0};
+    }
+    return 1;
+}
+
+#define PROF_INTERVAL 1000
+
+static int profile_start_lua(lua_State *L) {
+    newstate_t *state    = checknewstate(L);
+    int mode             = PROF_SAMPLE;
+    lua_Integer interval = PROF_INTERVAL;
+
+    if (state->prof.mode != PROF_NONE) {
+        return luaL_error(L, "profiler is already started");
+    } else if (!lua_isnoneornil(L, 2)) {
+        luaL_checktype(L, 2, LUA_TTABLE);
+        lua_getfield(L, 2, "mode");
+        switch (lua_type(L, -1)) {
+        case LUA_TNIL:
+            break;
+        case LUA_TSTRING:
+            if (strcmp(lua_tostring(L, -1), "count") == 0) {
+                mode = PROF_COUNT;
+                break;
+            } else if (strcmp(lua_tostring(L, -1), "sample") == 0) {
+                break;
+            }
+            // fallthrough
+        default:
+            luaL_error(L, "opts.mode must be \"sample\" or \"count\"");
+        }
+        lua_pop(L, 1);
+        interval = optinteger(L, 2, "interval", PROF_INTERVAL);
+        luaL_argcheck(L, interval > 0 && interval <= INT_MAX, 2,
+                      "opts.interval must be greater than 0");
+    }
+
+    newstate_prof_start(state->L, &state->prof, mode, (int)interval);
+    return 0;
+}
+
+static int profile_stop_lua(lua_State *L) {
+    newstate_t *state = checknewstate(L);
+    int collapsed     = 0;
+
+    if (!lua_isnoneornil(L, 2)) {
+        const char *format = luaL_checkstring(L, 2);
+
+        luaL_argcheck(L, strcmp(format, "collapsed") == 0, 2,
+                      "format must be \"collapsed\"");
+        luaL_argcheck(L, state->prof.mode != PROF_COUNT, 2,
+                      "\"collapsed\" format requires the sample mode");
+        collapsed = 1;
+    }
+    if (state->prof.mode == PROF_NONE) {
+        lua_pushnil(L);
+        return 1;
+    }
+    newstate_prof_stop(L, state->L, &state->prof, collapsed);
+    return 1;
+}
+
+// maximum number of the string cache entries
+#define STRCACHE_MAXSIZE (1 << 20)
+
+static int strcache_init(lua_State *L, newstate_t *state, lua_Integer n) {
+    strcache_t *cache = &state->strcache;
+    size_t size       = 1;
+
+    if (n <= 0) {
+        return 0;
+    } else if (n > STRCACHE_MAXSIZE) {
+        n = STRCACHE_MAXSIZE;
+    }
+    // round up to a power of 2
+    while (size < (size_t)n) {
+        size <<= 1;
+    }
+    if (!(cache->ptrs = calloc(size, sizeof(const char *)))) {
+        return -1;
+    }
+    cache->size = size;
+    lua_createtable(L, (int)size, 0);
+    cache->ref_src = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_createtable(state->L, (int)size, 0);
+    cache->ref_dst = luaL_ref(state->L, LUA_REGISTRYINDEX);
+    return 0;
+}
+
+// empties the string cache.
+static void strcache_reset(lua_State *L, newstate_t *state) {
+    strcache_t *cache = &state->strcache;
+
+    cache->hits   = 0;
+    cache->misses = 0;
+    if (!cache->size) {
+        return;
+    }
+    memset(cache->ptrs, 0, cache->size * sizeof(const char *));
+    lua_createtable(L, (int)cache->size, 0);
+    lua_rawseti(L, LUA_REGISTRYINDEX, cache->ref_src);
+    lua_createtable(state->L, (int)cache->size, 0);
+    lua_rawseti(state->L, LUA_REGISTRYINDEX, cache->ref_dst);
+}
+
+static inline int alloc_class(size_t size) {
+    if (size && size <= ALLOC_MAXSMALL) {
+        return (int)((size - 1) / ALLOC_ALIGN);
+    }
+    return -1;
+}
+
+// returns 1 if ptr is in a chunk of the arena.
+static int arena_owns(newstate_alloc_t *a, void *ptr) {
+    alloc_chunk_t *chunk = a->chunks;
+
+    for (; chunk; chunk = chunk->next) {
+        if ((uintptr_t)ptr >= (uintptr_t)chunk + ALLOC_ALIGN &&
+            (uintptr_t)ptr < (uintptr_t)chunk + ALLOC_CHUNKSIZE) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static inline void arena_free(newstate_alloc_t *a, void *ptr, int cls) {
+    // the chunks are searched only while the foreign blocks exist
+    if (a->nforeign && !arena_owns(a, ptr)) {
+        a->nforeign--;
+        free(ptr);
+        return;
+    }
+    *(void **)ptr     = a->freelist[cls];
+    a->freelist[cls] = ptr;
+}
+
+static void *arena_malloc(newstate_alloc_t *a, int cls) {
+    const size_t size = (size_t)(cls + 1) * ALLOC_ALIGN;
+    void *ptr         = a->freelist[cls];
 
-    while (idx <= eoi) {
-        const int t = lua_type(src, idx);
+    if (ptr) {
+        a->freelist[cls] = *(void **)ptr;
+        return ptr;
+    } else if (a->avail < size) {
+        alloc_chunk_t *chunk = malloc(ALLOC_CHUNKSIZE);
 
-        switch (t) {
-        case LUA_TNIL:
-            lua_pushnil(dst);
-            break;
+        if (!chunk) {
+            return NULL;
+        }
+        // put the rest of the current chunk into the free list.
+        // avail is always a multiple of ALLOC_ALIGN.
+        if (a->avail) {
+            arena_free(a, a->cur, alloc_class(a->avail));
+        }
+        chunk->next = a->chunks;
+        a->chunks   = chunk;
+        a->cur      = (char *)chunk + ALLOC_ALIGN;
+        a->avail    = ALLOC_CHUNKSIZE - ALLOC_ALIGN;
+    }
 
-        case LUA_TBOOLEAN:
-            lua_pushboolean(dst, lua_toboolean(src, idx));
-            break;
+    ptr = a->cur;
+    a->cur += size;
+    a->avail -= size;
+    return ptr;
+}
 
-        case LUA_TLIGHTUSERDATA:
-            lua_pushlightuserdata(dst, lua_touserdata(src, idx));
-            break;
+static void *arena_realloc(newstate_alloc_t *a, void *ptr, size_t osize,
+                           size_t nsize) {
+    const int ocls = ptr ? alloc_class(osize) : -1;
+    const int ncls = alloc_class(nsize);
+    void *newptr   = NULL;
 
-        case LUA_TNUMBER:
-            lua_pushnumber(dst, lua_tonumber(src, idx));
-            break;
+    if (nsize == 0) {
+        if (ocls >= 0) {
+            arena_free(a, ptr, ocls);
+        } else {
+            free(ptr);
+        }
+        return NULL;
+    } else if (ptr && ocls == ncls && ocls >= 0) {
+        return ptr;
+    } else if (ocls < 0 && ncls < 0) {
+        return realloc(ptr, nsize);
+    }
 
-        case LUA_TSTRING:
-            lua_pushlstring(dst, lua_tolstring(src, idx, &len), len);
-            break;
+    newptr = (ncls >= 0) ? arena_malloc(a, ncls) : malloc(nsize);
+    if (!newptr && ptr && nsize <= osize) {
+        // lua 5.1 to 5.3 assume that shrinking never fails, so the block is
+        // kept. the block of malloc() is freed by arena_free() later.
+        if (ocls < 0) {
+            a->nforeign++;
+        }
+        return ptr;
+    } else if (newptr && ptr) {
+        memcpy(newptr, ptr, osize < nsize ? osize : nsize);
+        if (ocls >= 0) {
+            arena_free(a, ptr, ocls);
+        } else {
+            free(ptr);
+        }
+    }
+    return newptr;
+}
 
-        case LUA_TTABLE:
-            lua_createtable(dst, tbllen(src, idx), 0);
-            lua_pushnil(src);
-            idx -= idx < 0;
-            while (lua_next(src, idx) != 0) {
-                if (moveit(src, dst, -2, -1) != 0) {
-                    return 2;
-                }
-                lua_rawset(dst, -3);
-                lua_pop(src, 1);
-            }
-            idx += idx < 0;
-            break;
+static void arena_destroy(newstate_alloc_t *a) {
+    alloc_chunk_t *chunk = a->chunks;
 
-        // case LUA_TFUNCTION:
-        // case LUA_TUSERDATA:
-        // case LUA_TTHREAD:
-        default:
-            lua_pushboolean(src, 0);
-            lua_pushfstring(src, "cannot exchange <%s> value",
-                            lua_typename(src, t));
-            lua_pushinteger(src, -1);
-            return 3;
-        }
-        idx++;
+    while (chunk) {
+        alloc_chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
     }
+    a->chunks   = NULL;
+    a->cur      = NULL;
+    a->avail    = 0;
+    a->nforeign = 0;
+    memset(a->freelist, 0, sizeof(a->freelist));
+}
 
-    return 0;
+// returns the index of the histogram bucket for size.
+static inline int alloc_bucket(size_t size) {
+    int i = 0;
+
+    if (size <= 8) {
+        return 0;
+    }
+#if defined(__GNUC__)
+    // number of bits of (size - 1) minus 3
+    i = (int)(sizeof(unsigned long long) * 8) -
+        __builtin_clzll((unsigned long long)(size - 1)) - 3;
+#else
+    for (size = (size - 1) >> 3; size; size >>= 1) {
+        i++;
+    }
+#endif
+    return i < ALLOC_NHIST ? i : ALLOC_NHIST - 1;
 }
 
-static inline int runit(lua_State *src, lua_State *dst) {
-    int rc = lua_pcall(dst, lua_gettop(dst) - 1, LUA_MULTRET, 0);
-    int nres = 0;
+static void *alloc_lua(void *ud, void *ptr, size_t osize, size_t nsize) {
+    newstate_alloc_t *a = (newstate_alloc_t *)ud;
+    void *newptr        = NULL;
 
-    if (rc) {
-        size_t len = 0;
-        lua_pushboolean(src, 0);
-        lua_pushlstring(src, luaL_checklstring(dst, 1, &len), len);
-        lua_pushinteger(src, rc);
-        return 3;
+    // osize is the type of the object if ptr is NULL
+    if (!ptr) {
+        osize = 0;
+    }
+    if (a->active && a->limit && nsize > osize &&
+        a->used + (nsize - osize) > a->limit) {
+        a->nfail++;
+        return NULL;
     }
 
-    lua_pushboolean(src, 1);
-    nres = lua_gettop(dst);
-    if (nres) {
-        rc = moveit(dst, src, 1, nres);
-        lua_settop(dst, 0);
-        if (rc) {
-            return rc;
+    if (a->arena) {
+        newptr = arena_realloc(a, ptr, osize, nsize);
+    } else if (nsize == 0) {
+        free(ptr);
+    } else {
+        newptr = realloc(ptr, nsize);
+    }
+
+    if (nsize == 0) {
+        a->nfree += ptr != NULL;
+        a->used -= osize;
+    } else if (!newptr) {
+        a->nfail++;
+    } else {
+        if (ptr) {
+            a->nrealloc++;
+        } else {
+            a->nalloc++;
+        }
+        a->hist[alloc_bucket(nsize)]++;
+        a->used = a->used - osize + nsize;
+        if (a->used > a->peak) {
+            a->peak = a->used;
         }
     }
+    return newptr;
+}
 
-    return 1 + nres;
+static int panic_lua(lua_State *L) {
+    const char *msg = lua_tostring(L, -1);
+
+    fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n",
+            msg ? msg : "error object is not a string");
+    fflush(stderr);
+    return 0;
 }
 
-static int run_lua(lua_State *L) {
-    newstate_t *state = luaL_checkudata(L, 1, MODULE_MT);
-    int rc = 0;
+// maximum number of the chunk cache entries
+#define CHUNKCACHE_MAXSIZE (1 << 16)
 
-    lua_settop(state->L, 0);
-    lua_rawgeti(state->L, LUA_REGISTRYINDEX, state->ref_fn);
-    if ((rc = moveit(L, state->L, 2, lua_gettop(L)))) {
-        lua_settop(state->L, 0);
-        return rc;
+static int chunkcache_init(newstate_t *state, lua_Integer n) {
+    chunkcache_t *cache = &state->chunkcache;
+
+    if (n <= 0) {
+        return 0;
+    } else if (n > CHUNKCACHE_MAXSIZE) {
+        n = CHUNKCACHE_MAXSIZE;
+    }
+    if (!(cache->ents = calloc((size_t)n, sizeof(chunkent_t)))) {
+        return -1;
     }
+    cache->size = (size_t)n;
+    lua_createtable(state->L, (int)n * 2, (int)n);
+    cache->ref = luaL_ref(state->L, LUA_REGISTRYINDEX);
+    return 0;
+}
 
-    return runit(L, state->L);
+// empties the chunk cache.
+static void chunkcache_reset(newstate_t *state) {
+    chunkcache_t *cache = &state->chunkcache;
+
+    cache->count  = 0;
+    cache->head   = 0;
+    cache->tail   = 0;
+    cache->hits   = 0;
+    cache->misses = 0;
+    if (!cache->size) {
+        return;
+    }
+    memset(cache->ents, 0, cache->size * sizeof(chunkent_t));
+    lua_createtable(state->L, (int)cache->size * 2, (int)cache->size);
+    lua_rawseti(state->L, LUA_REGISTRYINDEX, cache->ref);
 }
 
-typedef int (*loadfn)(lua_State *L, const char *src, size_t len,
-                      const char *name);
+// pushes a new newstate onto L. returns NULL and pushes nil on failure.
+static newstate_t *newstate(lua_State *L, newstate_opts_t *opts) {
+    newstate_t *state = lua_newuserdata(L, sizeof(newstate_t));
 
-static inline int loadit(lua_State *src, lua_State *dst, int idx, loadfn fn) {
-    size_t len = 0;
-    const char *s = luaL_checklstring(src, idx, &len);
-    int rc = 0;
+    *state = (newstate_t){
+        .L            = NULL,
+        .ref_fn       = LUA_NOREF,
+        .ref_fns      = LUA_NOREF,
+        .ref_snapshot = LUA_NOREF,
+        .ref_moved    = LUA_NOREF,
+        .limit        = {.interval = LIMIT_INTERVAL},
+        .gcmode =
+            {
+                .mode     = GCMODE_INC,
+                .stepsize = GC_STEPSIZE,
+                .minormul = GC_MINORMUL,
+                .majormul = GC_MAJORMUL,
+            },
+        .prof         = {.ref = LUA_NOREF},
+        .chunkcache   = {.ref = LUA_NOREF},
+        .strcache =
+            {
+                .ref_src = LUA_NOREF,
+                .ref_dst = LUA_NOREF,
+            },
+    };
+    luaL_getmetatable(L, MODULE_MT);
+    lua_setmetatable(L, -2);
 
-    lua_settop(dst, 0);
-    if ((rc = fn(dst, s, len, s))) {
-        lua_pushboolean(src, 0);
-        lua_pushlstring(src, luaL_checklstring(dst, 1, &len), len);
-        lua_pushinteger(src, rc);
-        return 3;
+    state->opts        = *opts;
+    state->alloc.limit = opts->memlimit;
+    state->alloc.arena = opts->arena;
+    if (!(state->L = lua_newstate(alloc_lua, &state->alloc)) ||
+        strcache_init(L, state, opts->strcache) != 0 ||
+        chunkcache_init(state, opts->chunkcache) != 0) {
+        lua_pushnil(L);
+        return NULL;
+    }
+    lua_atpanic(state->L, panic_lua);
+    if (opts->openlibs) {
+        openlibs(state->L, opts->libs, opts->lazy);
     }
 
-    return 0;
+    return state;
 }
 
-static inline int load_lua(lua_State *L, loadfn fn) {
-    newstate_t *state = luaL_checkudata(L, 1, MODULE_MT);
-    int rc = loadit(L, state->L, 2, fn);
+static int new_lua(lua_State *L) {
+    newstate_opts_t opts;
 
-    if (rc) {
-        lua_settop(state->L, 0);
-        return rc;
+    checkopts(L, 1, &opts);
+    newstate(L, &opts);
+    return 1;
+}
+
+static int gc__lua(lua_State *L) {
+    newstate_t *state = (newstate_t *)lua_touserdata(L, 1);
+
+    luaL_unref(L, LUA_REGISTRYINDEX, state->ref_moved);
+    state->ref_moved = LUA_NOREF;
+    state->moved     = NULL;
+
+    if (state->thread) {
+        pthread_join(state->tid, NULL);
+        state->thread = 0;
     }
-    // unref old func
-    luaL_unref(state->L, LUA_REGISTRYINDEX, state->ref_fn);
-    // maintain new func
-    state->ref_fn = luaL_ref(state->L, LUA_REGISTRYINDEX);
+    if (state->L) {
+        lua_close(state->L);
+        state->L = NULL;
+    }
+    free(state->unrefs);
+    state->unrefs   = NULL;
+    state->nunref   = 0;
+    state->capunref = 0;
+    arena_destroy(&state->alloc);
+    newstate_prof_free(&state->prof);
+    free(state->chunkcache.ents);
+    state->chunkcache = (chunkcache_t){.ref = LUA_NOREF};
+    state->ref_snapshot = LUA_NOREF;
+    luaL_unref(L, LUA_REGISTRYINDEX, state->strcache.ref_src);
+    free(state->strcache.ptrs);
+    state->strcache = (strcache_t){
+        .ref_src = LUA_NOREF,
+        .ref_dst = LUA_NOREF,
+    };
+    return 0;
+}
 
-    lua_pushboolean(L, 1);
+static int tostring_lua(lua_State *L) {
+    lua_pushfstring(L, MODULE_MT ": %p", lua_touserdata(L, 1));
     return 1;
 }
 
-static int loadstring_lua(lua_State *L) {
-    return load_lua(L, loadstring);
+// pushes a shallow copy of the table at idx.
+static inline void shallowcopy(lua_State *L, int idx) {
+    int narr = 0;
+    int nrec = 0;
+
+    idx = absindex(L, idx);
+    tblhint(L, idx, &narr, &nrec);
+    lua_createtable(L, narr, nrec);
+    lua_pushnil(L);
+    while (lua_next(L, idx) != 0) {
+        lua_pushvalue(L, -2);
+        lua_insert(L, -2);
+        lua_rawset(L, -4);
+    }
 }
 
-static int loadfile_lua(lua_State *L) {
-    return load_lua(L, loadfile);
+// restores the table at idx to the contents of the copy at cidx.
+static inline void restorecopy(lua_State *L, int idx, int cidx) {
+    idx  = absindex(L, idx);
+    cidx = absindex(L, cidx);
+    // remove the fields that are not in the copy
+    lua_pushnil(L);
+    while (lua_next(L, idx) != 0) {
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        lua_rawget(L, cidx);
+        if (lua_isnil(L, -1)) {
+            lua_pushvalue(L, -2);
+            lua_insert(L, -2);
+            lua_rawset(L, idx);
+        } else {
+            lua_pop(L, 1);
+        }
+    }
+    // restore the fields of the copy
+    lua_pushnil(L);
+    while (lua_next(L, cidx) != 0) {
+        lua_pushvalue(L, -2);
+        lua_insert(L, -2);
+        lua_rawset(L, idx);
+    }
 }
 
-static inline int do_lua(lua_State *L, loadfn fn) {
-    newstate_t *state = luaL_checkudata(L, 1, MODULE_MT);
-    int rc = 0;
+// adds the shallow copies of the tables in the fields of the table at idx to
+// the table at tidx, keyed by the copied tables. the tables already in tidx
+// are skipped, so the tables shared by the libraries are copied only once.
+static void copyfields(lua_State *L, int idx, int tidx) {
+    idx  = absindex(L, idx);
+    tidx = absindex(L, tidx);
+    lua_pushnil(L);
+    while (lua_next(L, idx) != 0) {
+        if (lua_istable(L, -1)) {
+            lua_pushvalue(L, -1);
+            lua_rawget(L, tidx);
+            if (lua_isnil(L, -1)) {
+                lua_pop(L, 1);
+                lua_pushvalue(L, -1);
+                shallowcopy(L, -1);
+                lua_rawset(L, tidx);
+            } else {
+                lua_pop(L, 1);
+            }
+        }
+        lua_pop(L, 1);
+    }
+}
 
-    if ((rc = loadit(L, state->L, 2, fn)) ||
-        (rc = moveit(L, state->L, 3, lua_gettop(L)))) {
-        lua_settop(state->L, 0);
-        return rc;
+// takes the snapshot of the globals, the loaded modules and the preloaded
+// functions of the newstate. the fields of the library and module tables in
+// them, and the metatable of the strings are also copied.
+static void snapshot(newstate_t *state) {
+    lua_State *L = state->L;
+
+    lua_settop(L, 0);
+    lua_createtable(L, 0, 8);
+    // 2: tables held by the globals and the loaded modules
+    lua_newtable(L);
+    lua_pushglobaltable(L);
+    lua_pushvalue(L, -1);
+    lua_pushboolean(L, 1);
+    lua_rawset(L, 2);
+    shallowcopy(L, -1);
+    lua_setfield(L, 1, "globals");
+    lua_getfield(L, LUA_REGISTRYINDEX, LOADED_KEY);
+    if (lua_istable(L, -1)) {
+        lua_pushvalue(L, -1);
+        lua_pushboolean(L, 1);
+        lua_rawset(L, 2);
+        shallowcopy(L, -1);
+        lua_setfield(L, 1, "loaded");
+        copyfields(L, -1, 2);
     }
+    lua_pop(L, 1);
+    copyfields(L, -1, 2);
+    lua_pop(L, 1);
+    lua_pushliteral(L, "");
+    if (lua_getmetatable(L, -1)) {
+        lua_pushvalue(L, -1);
+        shallowcopy(L, -1);
+        lua_rawset(L, 2);
+        lua_setfield(L, 1, "strmt");
+    }
+    lua_pop(L, 1);
+    lua_setfield(L, 1, "tables");
+    lua_pushinteger(L, gcparam(L, LUA_GCSETPAUSE));
+    lua_setfield(L, 1, "pause");
+    lua_pushinteger(L, gcparam(L, LUA_GCSETSTEPMUL));
+    lua_setfield(L, 1, "stepmul");
+    lua_rawgeti(L, LUA_REGISTRYINDEX, state->ref_fn);
+    lua_setfield(L, 1, "fn");
+    pushfns(state);
+    shallowcopy(L, -1);
+    lua_setfield(L, 1, "fns");
+    lua_pop(L, 1);
+    luaL_unref(L, LUA_REGISTRYINDEX, state->ref_snapshot);
+    state->ref_snapshot = luaL_ref(L, LUA_REGISTRYINDEX);
+}
 
-    return runit(L, state->L);
+// restores the collector to the incremental mode with the parameters of the
+// snapshot, in case the script or the caller has changed them.
+static void resetgc(newstate_t *state, int pause, int stepmul) {
+    lua_State *L = state->L;
+
+    lua_gc(L, LUA_GCRESTART, 0);
+#if LUA_VERSION_NUM >= 504
+    if (state->gcmode.minormul != GC_MINORMUL ||
+        state->gcmode.majormul != GC_MAJORMUL) {
+        lua_gc(L, LUA_GCGEN, GC_MINORMUL, GC_MAJORMUL);
+    }
+    lua_gc(L, LUA_GCINC, pause, stepmul, GC_STEPSIZE);
+#else
+#    if defined(LUA_GCGEN)
+    lua_gc(L, LUA_GCINC, 0);
+#    endif
+    lua_gc(L, LUA_GCSETPAUSE, pause);
+    lua_gc(L, LUA_GCSETSTEPMUL, stepmul);
+#endif
+    state->gcmode = (gcmode_t){
+        .mode     = GCMODE_INC,
+        .stepsize = GC_STEPSIZE,
+        .minormul = GC_MINORMUL,
+        .majormul = GC_MAJORMUL,
+    };
 }
 
-static int dostring_lua(lua_State *L) {
-    return do_lua(L, loadstring);
+// restores the newstate to the snapshot, and resets the settings and the
+// caches of the newstate that the previous user may have changed.
+static void reset(lua_State *parent, newstate_t *state) {
+    lua_State *L = state->L;
+
+    lua_settop(L, 0);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, state->ref_snapshot);
+    lua_pushglobaltable(L);
+    lua_getfield(L, 1, "globals");
+    restorecopy(L, 2, 3);
+    lua_settop(L, 1);
+    lua_getfield(L, LUA_REGISTRYINDEX, LOADED_KEY);
+    lua_getfield(L, 1, "loaded");
+    if (lua_istable(L, 2) && lua_istable(L, 3)) {
+        restorecopy(L, 2, 3);
+    }
+    lua_settop(L, 1);
+    lua_getfield(L, 1, "tables");
+    lua_pushnil(L);
+    while (lua_next(L, 2) != 0) {
+        if (lua_istable(L, -1)) {
+            restorecopy(L, -2, -1);
+        }
+        lua_pop(L, 1);
+    }
+    lua_settop(L, 1);
+    lua_pushliteral(L, "");
+    lua_getfield(L, 1, "strmt");
+    lua_setmetatable(L, 2);
+    lua_settop(L, 1);
+    pushfns(state);
+    lua_getfield(L, 1, "fns");
+    restorecopy(L, 2, 3);
+    lua_settop(L, 1);
+    lua_getfield(L, 1, "pause");
+    lua_getfield(L, 1, "stepmul");
+    resetgc(state, (int)lua_tointeger(L, 2), (int)lua_tointeger(L, 3));
+    lua_settop(L, 1);
+    luaL_unref(L, LUA_REGISTRYINDEX, state->ref_fn);
+    lua_getfield(L, 1, "fn");
+    state->ref_fn = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_settop(L, 0);
+
+    lua_sethook(L, NULL, 0, 0);
+    state->limit     = (limit_t){.interval = LIMIT_INTERVAL};
+    state->gcpolicy  = (gcpolicy_t){0};
+    state->traceback = 0;
+    if (state->prof.mode != PROF_NONE) {
+        luaL_unref(L, LUA_REGISTRYINDEX, state->prof.ref);
+        newstate_prof_free(&state->prof);
+    }
+    strcache_reset(parent, state);
+    chunkcache_reset(state);
+    state->metrics = (metrics_t){0};
 }
 
-static int dofile_lua(lua_State *L) {
-    return do_lua(L, loadfile);
+// registers the tables on the top of src and dst as the tables to be merged,
+// and pops them.
+static void xmerge(xmove_t *m) {
+    if (lua_istable(m->src, -1) && lua_istable(m->dst, -1)) {
+        lua_pushvalue(m->src, -1);
+        lua_rawget(m->src, m->sidx);
+        if (lua_isnil(m->src, -1)) {
+            xregister(m, lua_gettop(m->src) - 1);
+            m->nmerge = m->ntbl;
+        }
+        lua_pop(m->src, 1);
+    }
+    lua_pop(m->src, 1);
+    lua_pop(m->dst, 1);
 }
 
-static int gc_lua(lua_State *L) {
-    newstate_t *state = luaL_checkudata(L, 1, MODULE_MT);
-    int what = (int)luaL_checkinteger(L, 2);
-    int arg = (int)luaL_optinteger(L, 3, 0);
+// copies the global variables, the loaded modules and the preloaded
+// functions of the from into the to. the global table and the modules that are
+// loaded in both states are merged into the existing tables of the to.
+// returns 0 on success, -1 on memory allocation error, or the type of a value
+// that cannot be copied.
+static int cloneit(newstate_t *from, newstate_t *to) {
+    lua_State *src = from->L;
+    lua_State *dst = to->L;
+    xmetrics_t mx  = {0};
+    xmove_t m      = {.src = src, .dst = dst, .mx = &mx, .clone = 1};
+    int rc         = 0;
 
-    switch (what) {
+    lua_settop(src, 0);
+    lua_settop(dst, 0);
+    if (!lua_checkstack(src, MOVEIT_NSLOT) ||
+        !lua_checkstack(dst, MOVEIT_NSLOT)) {
+        return -1;
+    }
 
-#if defined(LUA_GCISRUNNING)
-    case LUA_GCISRUNNING:
-        lua_pushboolean(L, lua_gc(state->L, what, 0));
-        return 1;
-#endif
+    // open the libraries that have been opened lazily in the from
+    lua_getfield(src, LUA_REGISTRYINDEX, LOADED_KEY);
+    lua_getfield(dst, LUA_REGISTRYINDEX, LOADED_KEY);
+    if (lua_istable(src, 1) && lua_istable(dst, 1)) {
+        const libent_t *lib = LIBS;
 
-#if defined(LUA_GCINC)
-    case LUA_GCINC: {
-        int pause = arg;
-        int stepmul = (int)luaL_optinteger(L, 4, 0);
-        int stepsize = (int)luaL_optinteger(L, 5, 0);
-        lua_pushinteger(L, lua_gc(state->L, pause, stepmul, stepsize));
-        return 1;
+        for (; lib->name; lib++) {
+            if (lib->modname && !lib->eager) {
+                lua_getfield(src, 1, lib->modname);
+                lua_getfield(dst, 1, lib->modname);
+                if (!lua_isnil(src, -1) && lua_isnil(dst, -1)) {
+                    openlib(dst, lib->modname, lib->open);
+                }
+                lua_settop(src, 1);
+                lua_settop(dst, 1);
+            }
+        }
     }
+    lua_settop(src, 0);
+    lua_settop(dst, 0);
 
-#endif
+    // seen table and copies table
+    lua_newtable(src);
+    lua_newtable(dst);
+    m.sidx = m.didx = 1;
 
-#if defined(LUA_GCGEN)
-    case LUA_GCGEN: {
-        int minormul = arg;
-        int majormul = (int)luaL_optinteger(L, 4, 0);
-        lua_pushinteger(L, lua_gc(state->L, minormul, majormul));
+    lua_pushglobaltable(src);
+    lua_pushglobaltable(dst);
+    xmerge(&m);
+    lua_getfield(src, LUA_REGISTRYINDEX, LOADED_KEY);
+    lua_getfield(dst, LUA_REGISTRYINDEX, LOADED_KEY);
+    if (lua_istable(src, 2) && lua_istable(dst, 2)) {
+        lua_pushnil(src);
+        while (lua_next(src, 2) != 0) {
+            if (lua_type(src, -2) == LUA_TSTRING && lua_istable(src, -1)) {
+                lua_getfield(dst, 2, lua_tostring(src, -2));
+                lua_pushvalue(src, -1);
+                xmerge(&m);
+            }
+            lua_pop(src, 1);
+        }
+    }
+    xmerge(&m);
+
+    // preloaded functions
+    if (from->ref_fn != LUA_NOREF) {
+        lua_rawgeti(src, LUA_REGISTRYINDEX, from->ref_fn);
+        rc = xvalue(&m, 2);
+        lua_pop(src, 1);
+    }
+    if (!rc && from->ref_fns != LUA_NOREF) {
+        lua_rawgeti(src, LUA_REGISTRYINDEX, from->ref_fns);
+        rc = xvalue(&m, 2);
+        lua_pop(src, 1);
+    }
+    if (rc || (rc = xcontents(&m))) {
+        lua_settop(src, 0);
+        lua_settop(dst, 0);
+        return rc;
+    }
+
+    if (from->ref_fns != LUA_NOREF) {
+        to->ref_fns = luaL_ref(dst, LUA_REGISTRYINDEX);
+    }
+    if (from->ref_fn != LUA_NOREF) {
+        to->ref_fn = luaL_ref(dst, LUA_REGISTRYINDEX);
+    }
+    lua_settop(src, 0);
+    lua_settop(dst, 0);
+    return 0;
+}
+
+static int clone_lua(lua_State *L) {
+    newstate_t *state = checknewstate(L);
+    newstate_t *clone = newstate(L, &state->opts);
+    int rc            = 0;
+
+    if (!clone) {
         return 1;
     }
-#endif
+    clone->limit = state->limit;
+    if ((rc = cloneit(state, clone))) {
+        lua_pushnil(L);
+        if (rc < 0) {
+            lua_pushliteral(L, "not enough memory to clone the newstate");
+        } else {
+            lua_pushfstring(L, "cannot clone <%s> value", lua_typename(L, rc));
+        }
+        return 2;
+    }
+    return 1;
+}
 
-    default:
-        lua_pushinteger(L, lua_gc(state->L, what, arg));
+#define POOL_MT "newstate.pool"
+
+typedef struct {
+    newstate_opts_t opts;
+    // maximum number of idle newstates
+    int size;
+    // reference to the table of idle newstates
+    int ref_idle;
+    int nidle;
+    // reference to the source code of the preloaded function
+    int ref_preload;
+} newstate_pool_t;
+
+// pushes a new newstate of the pool onto L.
+static newstate_t *pool_newstate(lua_State *L, newstate_pool_t *pool) {
+    newstate_t *state = newstate(L, &pool->opts);
+
+    if (!state) {
+        return NULL;
+    } else if (pool->ref_preload != LUA_NOREF) {
+        size_t len    = 0;
+        const char *s = NULL;
+
+        lua_rawgeti(L, LUA_REGISTRYINDEX, pool->ref_preload);
+        s = lua_tolstring(L, -1, &len);
+        if (luaL_loadbuffer(state->L, s, len, s)) {
+            lua_pushstring(L, lua_tostring(state->L, -1));
+            lua_error(L);
+        }
+        state->ref_fn = luaL_ref(state->L, LUA_REGISTRYINDEX);
+        lua_pop(L, 1);
+    }
+    snapshot(state);
+    return state;
+}
+
+static int pool_acquire_lua(lua_State *L) {
+    newstate_pool_t *pool = luaL_checkudata(L, 1, POOL_MT);
+
+    if (pool->nidle) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, pool->ref_idle);
+        lua_rawgeti(L, -1, pool->nidle);
+        lua_pushnil(L);
+        lua_rawseti(L, -3, pool->nidle--);
+        ((newstate_t *)lua_touserdata(L, -1))->released = 0;
         return 1;
     }
+    pool_newstate(L, pool);
+    return 1;
 }
 
-static int new_lua(lua_State *L) {
-    int openlibs = 1;
-    newstate_t *state = NULL;
+static int pool_release_lua(lua_State *L) {
+    newstate_pool_t *pool = luaL_checkudata(L, 1, POOL_MT);
+    newstate_t *state     = luaL_checkudata(L, 2, MODULE_MT);
+    newstate_t *moved     = NULL;
+    int ref               = LUA_NOREF;
 
-    switch (lua_type(L, 1)) {
-    case LUA_TNONE:
-    case LUA_TNIL:
-        break;
-    default:
-        luaL_checktype(L, 1, LUA_TBOOLEAN);
-        openlibs = lua_toboolean(L, 1);
+    if (state->thread) {
+        return luaL_error(L, "newstate is running in the thread");
+    } else if (state->busy) {
+        return luaL_error(L, "newstate is loading the script");
+    } else if (state->released) {
+        return luaL_argerror(L, 2, "newstate is already released");
+    } else if (state->ref_snapshot == LUA_NOREF) {
+        return luaL_argerror(L, 2, "newstate is not created by the pool");
     }
 
-    state = lua_newuserdata(L, sizeof(newstate_t));
-    state->L = luaL_newstate();
-    if (state->L) {
-        if (openlibs) {
-            luaL_openlibs(state->L);
-        }
-        state->ref_fn = LUA_NOREF;
+    reset(L, state);
+    lua_settop(L, 2);
+    if (pool->nidle < pool->size) {
+        // the child state is moved to a new handle, so that the handle of
+        // the previous user cannot use it after it is acquired again. the
+        // errors are raised before the move.
         luaL_getmetatable(L, MODULE_MT);
+        moved = lua_newuserdata(L, sizeof(newstate_t));
+        lua_pushvalue(L, -1);
+        ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        lua_insert(L, -2);
+        *moved          = *state;
+        moved->released = 1;
+        lua_setallocf(moved->L, alloc_lua, &moved->alloc);
         lua_setmetatable(L, -2);
-    } else {
-        lua_pushnil(L);
+        *state = (newstate_t){
+            .ref_fn       = LUA_NOREF,
+            .ref_fns      = LUA_NOREF,
+            .ref_snapshot = LUA_NOREF,
+            .released     = 1,
+            .moved        = moved,
+            .ref_moved    = ref,
+            .prof         = {.ref = LUA_NOREF},
+            .chunkcache   = {.ref = LUA_NOREF},
+            .strcache =
+                {
+                    .ref_src = LUA_NOREF,
+                    .ref_dst = LUA_NOREF,
+                },
+        };
+        lua_rawgeti(L, LUA_REGISTRYINDEX, pool->ref_idle);
+        lua_insert(L, -2);
+        lua_rawseti(L, -2, ++pool->nidle);
+        return 0;
     }
-
-    return 1;
+    state->released = 1;
+    return 0;
 }
 
-static int gc__lua(lua_State *L) {
-    newstate_t *state = (newstate_t *)lua_touserdata(L, 1);
-    lua_close(state->L);
+static int pool_gc__lua(lua_State *L) {
+    newstate_pool_t *pool = (newstate_pool_t *)lua_touserdata(L, 1);
+
+    luaL_unref(L, LUA_REGISTRYINDEX, pool->ref_idle);
+    luaL_unref(L, LUA_REGISTRYINDEX, pool->ref_preload);
+    pool->ref_idle    = LUA_NOREF;
+    pool->ref_preload = LUA_NOREF;
+    pool->nidle       = 0;
     return 0;
 }
 
-static int tostring_lua(lua_State *L) {
-    lua_pushfstring(L, MODULE_MT ": %p", lua_touserdata(L, 1));
+static int pool_tostring_lua(lua_State *L) {
+    lua_pushfstring(L, POOL_MT ": %p", lua_touserdata(L, 1));
     return 1;
 }
 
-static void newmetatable_lua(lua_State *L) {
-    struct luaL_Reg mmethods[] = {
-        {"__gc", gc__lua}, {"__tostring", tostring_lua}, {NULL, NULL}};
-    struct luaL_Reg methods[] = {{"dofile", dofile_lua},
-                                 {"dostring", dostring_lua},
-                                 {"loadfile", loadfile_lua},
-                                 {"loadstring", loadstring_lua},
-                                 {"run", run_lua},
-                                 {"gc", gc_lua},
-                                 {NULL, NULL}};
+static int pool_lua(lua_State *L) {
+    int size              = (int)luaL_checkinteger(L, 1);
+    newstate_pool_t *pool = NULL;
+    int i                 = 0;
+
+    luaL_argcheck(L, size > 0, 1, "size must be greater than 0");
+    lua_settop(L, 2);
+    pool  = lua_newuserdata(L, sizeof(newstate_pool_t));
+    *pool = (newstate_pool_t){
+        .size        = size,
+        .ref_idle    = LUA_NOREF,
+        .ref_preload = LUA_NOREF,
+    };
+    checkopts(L, 2, &pool->opts);
+    if (lua_istable(L, 2)) {
+        lua_getfield(L, 2, "preload");
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+        } else if (lua_type(L, -1) == LUA_TSTRING) {
+            pool->ref_preload = luaL_ref(L, LUA_REGISTRYINDEX);
+        } else {
+            return luaL_error(L, "opts.preload must be string");
+        }
+    }
+    luaL_getmetatable(L, POOL_MT);
+    lua_setmetatable(L, -2);
+
+    // pre-create the newstates
+    lua_createtable(L, size, 0);
+    for (i = 1; i <= size; i++) {
+        if (!pool_newstate(L, pool)) {
+            lua_pushnil(L);
+            return 1;
+        }
+        lua_rawseti(L, -2, i);
+    }
+    pool->nidle    = size;
+    pool->ref_idle = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    return 1;
+}
+
+void newstate_createmetatable(lua_State *L, const char *tname,
+                              struct luaL_Reg *mmethods,
+                              struct luaL_Reg *methods) {
     struct luaL_Reg *fn = mmethods;
 
     // create metatable
-    luaL_newmetatable(L, MODULE_MT);
+    luaL_newmetatable(L, tname);
     // add metamethods
     while (fn->name) {
         lua_pushstring(L, fn->name);
@@ -326,12 +3582,79 @@ static void newmetatable_lua(lua_State *L) {
     lua_pop(L, 1);
 }
 
+static void newmetatable_lua(lua_State *L) {
+    struct luaL_Reg mmethods[] = {
+        {"__gc", gc__lua}, {"__tostring", tostring_lua}, {NULL, NULL}};
+    struct luaL_Reg methods[] = {{"dofile", dofile_lua},
+                                 {"dostring", dostring_lua},
+                                 {"loadfile", loadfile_lua},
+                                 {"loadstring", loadstring_lua},
+                                 {"load", loadreader_lua},
+                                 {"run", run_lua},
+                                 {"run_packed", run_packed_lua},
+                                 {"runmany", runmany_lua},
+                                 {"irunmany", irunmany_lua},
+                                 {"call", call_lua},
+                                 {"unload", unload_lua},
+                                 {"spawn", spawn_lua},
+                                 {"join", join_lua},
+                                 {"poll", poll_lua},
+                                 {"gc", gc_lua},
+                                 {"strcache", strcache_lua},
+                                 {"chunkcache", chunkcache_lua},
+                                 {"stats", stats_lua},
+                                 {"setlimits", setlimits_lua},
+                                 {"setgcpolicy", setgcpolicy_lua},
+                                 {"settraceback", settraceback_lua},
+                                 {"gcmode", gcmode_lua},
+                                 {"coroutine", coroutine_lua},
+                                 {"stream", stream_lua},
+                                 {"profile_start", profile_start_lua},
+                                 {"profile_stop", profile_stop_lua},
+                                 {"metrics", metrics_lua},
+                                 {"clone", clone_lua},
+                                 {NULL, NULL}};
+    struct luaL_Reg pool_mmethods[] = {{"__gc", pool_gc__lua},
+                                       {"__tostring", pool_tostring_lua},
+                                       {NULL, NULL}};
+    struct luaL_Reg pool_methods[] = {{"acquire", pool_acquire_lua},
+                                      {"release", pool_release_lua},
+                                      {NULL, NULL}};
+    struct luaL_Reg co_mmethods[] = {{"__gc", co_gc__lua},
+                                     {"__tostring", co_tostring_lua},
+                                     {NULL, NULL}};
+    struct luaL_Reg co_methods[] = {{"resume", co_resume_lua},
+                                    {"status", co_status_lua},
+                                    {NULL, NULL}};
+
+    newstate_createmetatable(L, MODULE_MT, mmethods, methods);
+    newstate_createmetatable(L, POOL_MT, pool_mmethods, pool_methods);
+    newstate_createmetatable(L, COROUTINE_MT, co_mmethods, co_methods);
+}
+
 LUALIB_API int luaopen_newstate(lua_State *L) {
-    struct luaL_Reg fns[] = {{"new", new_lua}, {NULL, NULL}};
+    struct luaL_Reg fns[] = {
+        {"new", new_lua},
+        {"pool", pool_lua},
+        {"buffer", newstate_buffer_lua},
+        {"array", newstate_array_lua},
+        {"channel", newstate_channel_lua},
+        {"scheduler", newstate_scheduler_lua},
+        {"shared", newstate_shared_lua},
+        {"compile", newstate_compile_lua},
+        {"pack", newstate_pack_lua},
+        {"unpack", newstate_unpack_lua},
+        {NULL, NULL},
+    };
     struct luaL_Reg *fn = fns;
 
     // create metatable
     newmetatable_lua(L);
+    newstate_buffer_init(L);
+    newstate_array_init(L);
+    newstate_channel_init(L);
+    newstate_shared_init(L);
+    newstate_scheduler_init(L);
     // create func table
     lua_newtable(L);
     while (fn->name) {
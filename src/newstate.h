@@ -0,0 +1,336 @@
+/**
+ *  Copyright (C) 2021 Masatoshi Fukunaga
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ *  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef newstate_h
+#define newstate_h
+
+#include <lauxlib.h>
+#include <lua.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MODULE_MT "newstate"
+
+// return code of the script aborted by the execution limits
+#define ERRLIMIT 64
+
+#if (LUA_VERSION_NUM > 501)
+#    define tbllen(L, idx) lua_rawlen(L, idx)
+#else
+#    define tbllen(L, idx) lua_objlen(L, idx)
+#endif
+
+#if LUA_VERSION_NUM < 502
+#    define lua_pushglobaltable(L) lua_pushvalue(L, LUA_GLOBALSINDEX)
+#endif
+
+#if LUA_VERSION_NUM >= 502
+#    define loadreader(L, reader, ud, name)                                    \
+        lua_load(L, reader, ud, name, NULL)
+#else
+#    define loadreader(L, reader, ud, name) lua_load(L, reader, ud, name)
+#endif
+
+// returns the time of the monotonic clock in nanoseconds.
+static inline uint64_t nanotime(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// sets the absolute time of the realtime clock after timeout seconds to ts,
+// for pthread_cond_timedwait.
+static inline void deadlineit(struct timespec *ts, lua_Number timeout) {
+    time_t sec = (time_t)timeout;
+
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += sec;
+    ts->tv_nsec += (long)((timeout - sec) * 1e9);
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+// reference counter shared between the states and the threads
+#define refcnt_incr(p) __atomic_add_fetch((p), 1, __ATOMIC_RELAXED)
+#define refcnt_decr(p) __atomic_sub_fetch((p), 1, __ATOMIC_ACQ_REL)
+
+static inline int absindex(lua_State *L, int idx) {
+    if (idx < 0 && idx > LUA_REGISTRYINDEX) {
+        return lua_gettop(L) + idx + 1;
+    }
+    return idx;
+}
+
+// returns the userdata at idx if its metatable is tname, or NULL.
+static inline void *testudata(lua_State *L, int idx, const char *tname) {
+    void *p = lua_touserdata(L, idx);
+
+    if (p && lua_getmetatable(L, idx)) {
+        luaL_getmetatable(L, tname);
+        if (!lua_rawequal(L, -1, -2)) {
+            p = NULL;
+        }
+        lua_pop(L, 2);
+        return p;
+    }
+    return NULL;
+}
+
+// returns true if the value at idx is an integer key in the range [1, narr].
+static inline int isarraykey(lua_State *L, int idx, int narr) {
+#if LUA_VERSION_NUM >= 503
+    if (lua_isinteger(L, idx)) {
+        lua_Integer i = lua_tointeger(L, idx);
+        return i > 0 && i <= narr;
+    }
+#else
+    if (lua_type(L, idx) == LUA_TNUMBER) {
+        lua_Number n = lua_tonumber(L, idx);
+        return n >= 1 && n <= narr && n == (lua_Number)(int)n;
+    }
+#endif
+    return 0;
+}
+
+// gets the length of the sequence part of the table at idx as narr, and the
+// number of the other fields as nrec.
+static inline void tblsize(lua_State *L, int idx, int *narr, int *nrec) {
+    const int len = (int)tbllen(L, idx);
+    int n         = 0;
+
+    lua_pushnil(L);
+    while (lua_next(L, idx) != 0) {
+        lua_pop(L, 1);
+        n += !isarraykey(L, -1, len);
+    }
+    *narr = len;
+    *nrec = n;
+}
+
+// number of the fields looked at by tblhint()
+#define TBLHINT_NPROBE 32
+
+// gets the sizes like tblsize(), but looks at up to TBLHINT_NPROBE fields.
+// returns 1 if all fields are looked at so that nrec is exact, or 0 if nrec
+// is the number of the other fields found so far.
+static inline int tblhint(lua_State *L, int idx, int *narr, int *nrec) {
+    const int len = (int)tbllen(L, idx);
+    int n         = 0;
+    int i         = 0;
+
+    *narr = len;
+    lua_pushnil(L);
+    for (; i < TBLHINT_NPROBE; i++) {
+        if (lua_next(L, idx) == 0) {
+            *nrec = n;
+            return 1;
+        }
+        lua_pop(L, 1);
+        n += !isarraykey(L, -1, len);
+    }
+    lua_pop(L, 1);
+    *nrec = n;
+    return 0;
+}
+
+void newstate_createmetatable(lua_State *L, const char *tname,
+                              struct luaL_Reg *mmethods,
+                              struct luaL_Reg *methods);
+
+// buffer.c
+#define BUFFER_MT "newstate.buffer"
+
+typedef struct {
+    int refcnt;
+    size_t len;
+    char data[];
+} newstate_buffer_t;
+
+// creates the metatable of the buffer in L if it does not exist.
+void newstate_buffer_init(lua_State *L);
+// pushes a new reference to buf onto L.
+void newstate_buffer_push(lua_State *L, newstate_buffer_t *buf);
+// pushes a new buffer that contains a copy of s onto L.
+// returns -1 on memory allocation error.
+int newstate_buffer_pushnew(lua_State *L, const char *s, size_t len);
+int newstate_buffer_lua(lua_State *L);
+
+// array.c
+#define ARRAY_MT "newstate.array"
+
+enum {
+    ARRAY_F64 = 0,
+    ARRAY_F32,
+    ARRAY_I64,
+    ARRAY_I32,
+    ARRAY_U8,
+};
+
+typedef struct {
+    int refcnt;
+    int type;
+    // set once the array is passed to another state, so that the elements
+    // shared between the states and the threads are never written
+    int readonly;
+    // number of the elements
+    size_t len;
+    char data[] __attribute__((aligned(8)));
+} newstate_array_t;
+
+// returns the size of the element of the type, or 0 if the type is invalid.
+size_t newstate_array_size(int type);
+// creates the metatable of the array in L if it does not exist.
+void newstate_array_init(lua_State *L);
+// pushes a new reference to arr onto L, and makes arr read-only.
+void newstate_array_push(lua_State *L, newstate_array_t *arr);
+// pushes a new array of len elements that contains a copy of data, or zeros
+// if data is NULL, onto L. returns -1 on error.
+int newstate_array_pushnew(lua_State *L, int type, size_t len,
+                           const char *data);
+int newstate_array_lua(lua_State *L);
+
+// channel.c
+#define CHANNEL_MT "newstate.channel"
+
+typedef struct newstate_channel_t newstate_channel_t;
+
+// creates the metatable of the channel in L if it does not exist.
+void newstate_channel_init(lua_State *L);
+// pushes a new reference to ch onto L.
+void newstate_channel_push(lua_State *L, newstate_channel_t *ch);
+int newstate_channel_lua(lua_State *L);
+
+// shared.c
+#define SHARED_MT "newstate.shared"
+
+typedef struct newstate_shared_t newstate_shared_t;
+
+// reference to a table of the frozen data
+typedef struct {
+    newstate_shared_t *sh;
+    const void *tbl;
+} newstate_shared_ref_t;
+
+// creates the metatable of the shared table in L if it does not exist.
+void newstate_shared_init(lua_State *L);
+// pushes the userdata of the table referenced by ref onto L.
+void newstate_shared_push(lua_State *L, newstate_shared_ref_t *ref);
+int newstate_shared_lua(lua_State *L);
+
+// scheduler.c
+#define SCHEDULER_MT "newstate.scheduler"
+#define FUTURE_MT    "newstate.future"
+
+// creates the metatables of the scheduler and the future in L.
+void newstate_scheduler_init(lua_State *L);
+int newstate_scheduler_lua(lua_State *L);
+
+// profile.c
+#define PROF_NONE     0
+#define PROF_SAMPLE   1
+#define PROF_COUNT    2
+#define PROF_MAXDEPTH 64
+
+typedef struct {
+    size_t calls;
+    uint64_t ns;
+} newstate_prof_ent_t;
+
+typedef struct {
+    size_t id;
+    uint64_t start;
+    int tail;
+} newstate_prof_frame_t;
+
+typedef struct {
+    int mode;
+    // number of the instructions between the samples
+    int interval;
+    int tick;
+    size_t nsample;
+    // reference to the table of the collected data in the child state
+    int ref;
+    // per-function statistics indexed by the function id - 1
+    newstate_prof_ent_t *ents;
+    size_t nent;
+    size_t entcap;
+    // call stack of the count mode
+    newstate_prof_frame_t *frames;
+    size_t nframe;
+    size_t framecap;
+    // number of the calls that could not be recorded
+    size_t ndrop;
+} newstate_prof_t;
+
+void newstate_prof_start(lua_State *L, newstate_prof_t *prof, int mode,
+                         int interval);
+void newstate_prof_free(newstate_prof_t *prof);
+// records a sample of the call stack of L every interval instructions.
+void newstate_prof_sample(lua_State *L, newstate_prof_t *prof, int count);
+// records the call and return events of L.
+void newstate_prof_call(lua_State *L, newstate_prof_t *prof, lua_Debug *ar);
+// discards the call stack of the count mode after each call.
+void newstate_prof_reset(newstate_prof_t *prof);
+// pushes the collected data of the child state co onto L and stops the
+// profiler.
+void newstate_prof_stop(lua_State *L, lua_State *co, newstate_prof_t *prof,
+                        int collapsed);
+
+// compile.c
+// loads the chunk file through mmap. returns the status of lua_load, or
+// LUA_ERRFILE if the file cannot be read.
+int newstate_loadmmap(lua_State *L, const char *path, const char *chunkname);
+// writes the bytecode of the function on the top of L to the path
+// atomically. returns 0 on success, or -1 and sets errno on failure.
+int newstate_dumpfile(lua_State *L, const char *path);
+int newstate_compile_lua(lua_State *L);
+
+// pack.c
+#define PACK_INITSIZE 4096
+
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t cap;
+    char init[PACK_INITSIZE];
+} newstate_pack_t;
+
+void newstate_pack_init(newstate_pack_t *pk);
+void newstate_pack_free(newstate_pack_t *pk);
+// serializes the values from idx to eoi of L into pk.
+// returns 0 on success, -1 on memory allocation error, or the type of a
+// value that cannot be serialized.
+int newstate_pack(lua_State *L, int idx, int eoi, newstate_pack_t *pk);
+// pushes the values deserialized from the data.
+// returns the number of the values, or -1 if the data is malformed or the
+// stack cannot be grown.
+int newstate_unpack(lua_State *L, const char *data, size_t len);
+int newstate_pack_lua(lua_State *L);
+int newstate_unpack_lua(lua_State *L);
+
+#endif
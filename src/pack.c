@@ -0,0 +1,588 @@
+/**
+ *  Copyright (C) 2021 Masatoshi Fukunaga
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ *  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ */
+
+#include "newstate.h"
+
+// tags of the packed values
+enum {
+    TAG_NIL = 0,
+    TAG_FALSE,
+    TAG_TRUE,
+    TAG_INT,
+    TAG_NUM,
+    TAG_STR,
+    // new table: narr, nrec
+    TAG_TABLE,
+    // table already packed: id
+    TAG_REF,
+    TAG_LUDATA,
+    TAG_BUFFER,
+    // typed array: len, type and the elements
+    TAG_ARRAY,
+};
+
+// header: magic, version, flags and the number of values
+#define PACK_MAGIC     0x4e
+#define PACK_VERSION   1
+#define PACK_HASTABLE  0x1
+#define PACK_FLAGS_POS 2
+
+// number of stack slots used in addition to the unpacked values
+#define PACK_NSLOT 8
+
+void newstate_pack_init(newstate_pack_t *pk) {
+    pk->buf = pk->init;
+    pk->len = 0;
+    pk->cap = PACK_INITSIZE;
+}
+
+void newstate_pack_free(newstate_pack_t *pk) {
+    if (pk->buf != pk->init) {
+        free(pk->buf);
+    }
+    newstate_pack_init(pk);
+}
+
+static inline char *reserve(newstate_pack_t *pk, size_t n) {
+    if (pk->cap - pk->len < n) {
+        size_t cap = pk->cap * 2;
+        char *buf  = NULL;
+
+        while (cap - pk->len < n) {
+            cap *= 2;
+        }
+        if (pk->buf != pk->init) {
+            buf = realloc(pk->buf, cap);
+        } else if ((buf = malloc(cap))) {
+            memcpy(buf, pk->init, pk->len);
+        }
+        if (!buf) {
+            return NULL;
+        }
+        pk->buf = buf;
+        pk->cap = cap;
+    }
+    return pk->buf + pk->len;
+}
+
+static inline int putbyte(newstate_pack_t *pk, int c) {
+    char *p = reserve(pk, 1);
+
+    if (!p) {
+        return -1;
+    }
+    *p = (char)c;
+    pk->len++;
+    return 0;
+}
+
+static inline int putbytes(newstate_pack_t *pk, const void *data, size_t n) {
+    char *p = reserve(pk, n);
+
+    if (!p) {
+        return -1;
+    }
+    memcpy(p, data, n);
+    pk->len += n;
+    return 0;
+}
+
+static inline int putvarint(newstate_pack_t *pk, uint64_t v) {
+    unsigned char *p = (unsigned char *)reserve(pk, 10);
+    size_t n         = 0;
+
+    if (!p) {
+        return -1;
+    }
+    while (v >= 0x80) {
+        p[n++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (unsigned char)v;
+    pk->len += n;
+    return 0;
+}
+
+static inline int puttagged(newstate_pack_t *pk, int tag, uint64_t v) {
+    if (putbyte(pk, tag) || putvarint(pk, v)) {
+        return -1;
+    }
+    return 0;
+}
+
+static inline int putint(newstate_pack_t *pk, int64_t v) {
+    // zigzag encoding
+    uint64_t z = (v < 0) ? ~((uint64_t)v << 1) : ((uint64_t)v << 1);
+    return puttagged(pk, TAG_INT, z);
+}
+
+typedef struct {
+    lua_State *L;
+    newstate_pack_t *pk;
+    // index of the table of the packed tables
+    int sidx;
+    int ntbl;
+} packer_t;
+
+static int packvalue(packer_t *p, int idx) {
+    lua_State *L        = p->L;
+    newstate_pack_t *pk = p->pk;
+    const int t         = lua_type(L, idx);
+    size_t len          = 0;
+    const char *s       = NULL;
+    void *ptr           = NULL;
+    double num          = 0;
+    int id              = 0;
+    int narr            = 0;
+    int nrec            = 0;
+
+    switch (t) {
+    case LUA_TNIL:
+        return putbyte(pk, TAG_NIL);
+
+    case LUA_TBOOLEAN:
+        return putbyte(pk, lua_toboolean(L, idx) ? TAG_TRUE : TAG_FALSE);
+
+    case LUA_TLIGHTUSERDATA:
+        ptr = lua_touserdata(L, idx);
+        if (putbyte(pk, TAG_LUDATA)) {
+            return -1;
+        }
+        return putbytes(pk, &ptr, sizeof(ptr));
+
+    case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+        if (lua_isinteger(L, idx)) {
+            return putint(pk, (int64_t)lua_tointeger(L, idx));
+        }
+        num = (double)lua_tonumber(L, idx);
+#else
+        num = (double)lua_tonumber(L, idx);
+        if (num >= -9007199254740992.0 && num <= 9007199254740992.0 &&
+            num == (double)(int64_t)num) {
+            return putint(pk, (int64_t)num);
+        }
+#endif
+        if (putbyte(pk, TAG_NUM)) {
+            return -1;
+        }
+        return putbytes(pk, &num, sizeof(num));
+
+    case LUA_TSTRING:
+        s = lua_tolstring(L, idx, &len);
+        if (puttagged(pk, TAG_STR, len)) {
+            return -1;
+        }
+        return putbytes(pk, s, len);
+
+    case LUA_TTABLE:
+        if (!p->sidx) {
+            // values are packed at the top of the stack at this point
+            lua_newtable(L);
+            p->sidx = lua_gettop(L);
+        }
+        lua_pushvalue(L, idx);
+        lua_rawget(L, p->sidx);
+        id = (int)lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        if (id) {
+            return puttagged(pk, TAG_REF, (uint64_t)id);
+        }
+        id = ++p->ntbl;
+        // seen[tbl] = id, seen[id] = tbl, seen[-id] = narr
+        lua_pushvalue(L, idx);
+        lua_pushinteger(L, id);
+        lua_rawset(L, p->sidx);
+        lua_pushvalue(L, idx);
+        lua_rawseti(L, p->sidx, id);
+        tblsize(L, idx, &narr, &nrec);
+        lua_pushinteger(L, narr);
+        lua_rawseti(L, p->sidx, -id);
+        if (puttagged(pk, TAG_TABLE, (uint64_t)narr)) {
+            return -1;
+        }
+        return putvarint(pk, (uint64_t)nrec);
+
+    case LUA_TUSERDATA:
+        if ((ptr = testudata(L, idx, BUFFER_MT))) {
+            newstate_buffer_t *buf = *(newstate_buffer_t **)ptr;
+            if (puttagged(pk, TAG_BUFFER, buf->len)) {
+                return -1;
+            }
+            return putbytes(pk, buf->data, buf->len);
+        } else if ((ptr = testudata(L, idx, ARRAY_MT))) {
+            newstate_array_t *arr = *(newstate_array_t **)ptr;
+            if (puttagged(pk, TAG_ARRAY, arr->len) ||
+                putbyte(pk, arr->type)) {
+                return -1;
+            }
+            return putbytes(pk, arr->data,
+                            arr->len * newstate_array_size(arr->type));
+        }
+        return t;
+
+    // case LUA_TFUNCTION:
+    // case LUA_TTHREAD:
+    default:
+        return t;
+    }
+}
+
+// packs the contents of the tables in the order of their ids: narr values
+// of the sequence part, and nrec key-value pairs as counted by TAG_TABLE.
+static int packtables(packer_t *p) {
+    lua_State *L   = p->L;
+    const int tidx = p->sidx + 1;
+    int id         = 0;
+    int i          = 0;
+    int rc         = 0;
+
+    for (id = 1; id <= p->ntbl; id++) {
+        int narr = 0;
+
+        lua_rawgeti(L, p->sidx, -id);
+        narr = (int)lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        lua_rawgeti(L, p->sidx, id);
+        for (i = 1; i <= narr; i++) {
+            lua_rawgeti(L, tidx, i);
+            if ((rc = packvalue(p, tidx + 1))) {
+                return rc;
+            }
+            lua_pop(L, 1);
+        }
+        lua_pushnil(L);
+        while (lua_next(L, tidx) != 0) {
+            if (!isarraykey(L, tidx + 1, narr) &&
+                ((rc = packvalue(p, tidx + 1)) ||
+                 (rc = packvalue(p, tidx + 2)))) {
+                return rc;
+            }
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+    }
+    return 0;
+}
+
+int newstate_pack(lua_State *L, int idx, int eoi, newstate_pack_t *pk) {
+    const int top = lua_gettop(L);
+    packer_t p    = {L, pk, 0, 0};
+    int rc        = 0;
+
+    idx = absindex(L, idx);
+    eoi = absindex(L, eoi);
+    if (!lua_checkstack(L, PACK_NSLOT) || putbyte(pk, PACK_MAGIC) ||
+        putbyte(pk, PACK_VERSION) || putbyte(pk, 0) ||
+        putvarint(pk, (uint64_t)(idx <= eoi ? eoi - idx + 1 : 0))) {
+        return -1;
+    }
+    for (; idx <= eoi; idx++) {
+        if ((rc = packvalue(&p, idx))) {
+            lua_settop(L, top);
+            return rc;
+        }
+    }
+    if (p.ntbl) {
+        pk->buf[PACK_FLAGS_POS] |= PACK_HASTABLE;
+        rc = packtables(&p);
+    }
+    lua_settop(L, top);
+    return rc;
+}
+
+typedef struct {
+    lua_State *L;
+    const unsigned char *p;
+    const unsigned char *e;
+    // index of the table of the unpacked tables, followed by the table of
+    // their narr and nrec
+    int tidx;
+    int ntbl;
+    // length of the data, and the total count of the elements read so far
+    size_t len;
+    size_t nelem;
+} unpacker_t;
+
+static inline int getvarint(unpacker_t *u, uint64_t *v) {
+    uint64_t x = 0;
+    int shift  = 0;
+
+    while (u->p < u->e && shift < 64) {
+        unsigned char c = *u->p++;
+        x |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            *v = x;
+            return 0;
+        }
+        shift += 7;
+    }
+    return -1;
+}
+
+// gets a count of the elements encoded in at least unit bytes each. the count
+// must not exceed the remaining bytes, and it is added to *total that must
+// not exceed the length of the data, so the counts of all tables together
+// cannot make the tables larger than the data allows.
+static inline int getcount(unpacker_t *u, int *n, size_t unit, size_t *total) {
+    uint64_t v = 0;
+
+    if (getvarint(u, &v) || v > INT32_MAX ||
+        v * unit > (uint64_t)(u->e - u->p) || v * unit > u->len - *total) {
+        return -1;
+    }
+    *total += (size_t)v * unit;
+    *n = (int)v;
+    return 0;
+}
+
+static int unpackvalue(unpacker_t *u) {
+    lua_State *L = u->L;
+    uint64_t v   = 0;
+    void *ptr    = NULL;
+    double num   = 0;
+    int narr     = 0;
+    int nrec     = 0;
+
+    if (u->p >= u->e) {
+        return -1;
+    }
+
+    switch (*u->p++) {
+    case TAG_NIL:
+        lua_pushnil(L);
+        return 0;
+
+    case TAG_FALSE:
+        lua_pushboolean(L, 0);
+        return 0;
+
+    case TAG_TRUE:
+        lua_pushboolean(L, 1);
+        return 0;
+
+    case TAG_INT:
+        if (getvarint(u, &v)) {
+            return -1;
+        }
+        lua_pushinteger(L, (lua_Integer)((int64_t)(v >> 1) ^ -(int64_t)(v & 1)));
+        return 0;
+
+    case TAG_NUM:
+        if ((size_t)(u->e - u->p) < sizeof(num)) {
+            return -1;
+        }
+        memcpy(&num, u->p, sizeof(num));
+        u->p += sizeof(num);
+        lua_pushnumber(L, (lua_Number)num);
+        return 0;
+
+    case TAG_STR:
+        if (getvarint(u, &v) || v > (uint64_t)(u->e - u->p)) {
+            return -1;
+        }
+        lua_pushlstring(L, (const char *)u->p, (size_t)v);
+        u->p += v;
+        return 0;
+
+    case TAG_TABLE:
+        if (!u->tidx || u->ntbl == INT32_MAX / 2 ||
+            getcount(u, &narr, 1, &u->nelem) ||
+            getcount(u, &nrec, 2, &u->nelem)) {
+            return -1;
+        }
+        lua_createtable(L, narr, nrec);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, u->tidx, ++u->ntbl);
+        // keep the counts for unpacktables()
+        lua_pushinteger(L, narr);
+        lua_rawseti(L, u->tidx + 1, u->ntbl * 2 - 1);
+        lua_pushinteger(L, nrec);
+        lua_rawseti(L, u->tidx + 1, u->ntbl * 2);
+        return 0;
+
+    case TAG_REF:
+        if (getvarint(u, &v) || v < 1 || v > (uint64_t)u->ntbl) {
+            return -1;
+        }
+        lua_rawgeti(L, u->tidx, (int)v);
+        return 0;
+
+    case TAG_LUDATA:
+        if ((size_t)(u->e - u->p) < sizeof(ptr)) {
+            return -1;
+        }
+        memcpy(&ptr, u->p, sizeof(ptr));
+        u->p += sizeof(ptr);
+        lua_pushlightuserdata(L, ptr);
+        return 0;
+
+    case TAG_BUFFER:
+        if (getvarint(u, &v) || v > (uint64_t)(u->e - u->p) ||
+            newstate_buffer_pushnew(L, (const char *)u->p, (size_t)v)) {
+            return -1;
+        }
+        u->p += v;
+        return 0;
+
+    case TAG_ARRAY: {
+        size_t size = 0;
+
+        if (getvarint(u, &v) || u->p == u->e ||
+            !(size = newstate_array_size(*u->p)) ||
+            v > (uint64_t)(u->e - u->p - 1) / size ||
+            newstate_array_pushnew(L, *u->p, (size_t)v,
+                                   (const char *)u->p + 1)) {
+            return -1;
+        }
+        u->p += 1 + v * size;
+        return 0;
+    }
+
+    default:
+        return -1;
+    }
+}
+
+static inline int isvalidkey(lua_State *L, int idx) {
+    switch (lua_type(L, idx)) {
+    case LUA_TNIL:
+        return 0;
+    case LUA_TNUMBER:
+        // NaN
+        return lua_tonumber(L, idx) == lua_tonumber(L, idx);
+    default:
+        return 1;
+    }
+}
+
+static int unpacktables(unpacker_t *u) {
+    lua_State *L = u->L;
+    int id       = 0;
+    int i        = 0;
+
+    for (id = 1; id <= u->ntbl; id++) {
+        int narr = 0;
+        int nrec = 0;
+
+        lua_rawgeti(L, u->tidx + 1, id * 2 - 1);
+        lua_rawgeti(L, u->tidx + 1, id * 2);
+        narr = (int)lua_tointeger(L, -2);
+        nrec = (int)lua_tointeger(L, -1);
+        lua_pop(L, 2);
+        lua_rawgeti(L, u->tidx, id);
+        for (i = 1; i <= narr; i++) {
+            if (unpackvalue(u)) {
+                return -1;
+            } else if (lua_isnil(L, -1)) {
+                lua_pop(L, 1);
+            } else {
+                lua_rawseti(L, -2, i);
+            }
+        }
+        for (i = 0; i < nrec; i++) {
+            if (unpackvalue(u) || !isvalidkey(L, -1) || unpackvalue(u)) {
+                return -1;
+            }
+            lua_rawset(L, -3);
+        }
+        lua_pop(L, 1);
+    }
+    return 0;
+}
+
+int newstate_unpack(lua_State *L, const char *data, size_t len) {
+    const int top = lua_gettop(L);
+    unpacker_t u  = {
+        .L   = L,
+        .p   = (const unsigned char *)data,
+        .e   = (const unsigned char *)data + len,
+        .len = len,
+    };
+    int flags = 0;
+    int n     = 0;
+    int i     = 0;
+
+    if (len < 3 || u.p[0] != PACK_MAGIC || u.p[1] != PACK_VERSION) {
+        return -1;
+    }
+    flags = u.p[PACK_FLAGS_POS];
+    u.p += 3;
+    if (getcount(&u, &n, 1, &u.nelem) || !lua_checkstack(L, n + PACK_NSLOT)) {
+        return -1;
+    }
+    if (flags & PACK_HASTABLE) {
+        lua_newtable(L);
+        u.tidx = lua_gettop(L);
+        lua_newtable(L);
+    }
+
+    for (i = 0; i < n; i++) {
+        if (unpackvalue(&u)) {
+            goto FAIL;
+        }
+    }
+    if ((u.tidx && unpacktables(&u)) || u.p != u.e) {
+        goto FAIL;
+    }
+    if (u.tidx) {
+        lua_remove(L, u.tidx);
+        lua_remove(L, u.tidx);
+    }
+    return n;
+
+FAIL:
+    lua_settop(L, top);
+    return -1;
+}
+
+int newstate_pack_lua(lua_State *L) {
+    newstate_pack_t pk;
+    int rc = 0;
+
+    newstate_pack_init(&pk);
+    if ((rc = newstate_pack(L, 1, lua_gettop(L), &pk))) {
+        newstate_pack_free(&pk);
+        lua_pushnil(L);
+        if (rc < 0) {
+            lua_pushliteral(L, "not enough memory");
+        } else {
+            lua_pushfstring(L, "cannot pack <%s> value", lua_typename(L, rc));
+        }
+        return 2;
+    }
+    lua_pushlstring(L, pk.buf, pk.len);
+    newstate_pack_free(&pk);
+    return 1;
+}
+
+int newstate_unpack_lua(lua_State *L) {
+    size_t len       = 0;
+    const char *data = luaL_checklstring(L, 1, &len);
+    int n            = 0;
+
+    lua_settop(L, 1);
+    if ((n = newstate_unpack(L, data, len)) < 0) {
+        return luaL_error(L, "malformed packed data");
+    }
+    return n;
+}
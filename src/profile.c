@@ -0,0 +1,271 @@
+/**
+ *  Copyright (C) 2021 Masatoshi Fukunaga
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ *  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ */
+
+#include "newstate.h"
+
+// pushes the name of the function of ar like "name@source:line".
+static void pushframename(lua_State *L, lua_Debug *ar) {
+    const char *name = ar->name ? ar->name : "?";
+
+    if (*ar->what == 'C') {
+        lua_pushfstring(L, "%s@[C]", name);
+    } else if (*ar->what == 'm') {
+        lua_pushfstring(L, "main@%s", ar->short_src);
+    } else {
+        lua_pushfstring(L, "%s@%s:%d", name, ar->short_src, ar->linedefined);
+    }
+}
+
+void newstate_prof_start(lua_State *L, newstate_prof_t *prof, int mode,
+                         int interval) {
+    newstate_prof_free(prof);
+    lua_newtable(L);
+    prof->ref      = luaL_ref(L, LUA_REGISTRYINDEX);
+    prof->mode     = mode;
+    prof->interval = interval;
+}
+
+void newstate_prof_free(newstate_prof_t *prof) {
+    free(prof->ents);
+    free(prof->frames);
+    *prof = (newstate_prof_t){
+        .mode = PROF_NONE,
+        .ref  = LUA_NOREF,
+    };
+}
+
+void newstate_prof_sample(lua_State *L, newstate_prof_t *prof, int count) {
+    const int top = lua_gettop(L);
+    lua_Debug ar;
+    int n = 0;
+    int i = 0;
+
+    prof->tick += count;
+    if (prof->tick < prof->interval) {
+        return;
+    }
+    prof->tick = 0;
+
+    // push the frame names from the innermost
+    while (n < PROF_MAXDEPTH && lua_getstack(L, n, &ar) &&
+           lua_checkstack(L, 3)) {
+        lua_getinfo(L, "Sn", &ar);
+        pushframename(L, &ar);
+        n++;
+    }
+    if (!n || !lua_checkstack(L, n * 2 + 2)) {
+        lua_settop(L, top);
+        return;
+    }
+    // concatenate them from the outermost
+    for (i = n; i > 0; i--) {
+        lua_pushvalue(L, top + i);
+        if (i > 1) {
+            lua_pushliteral(L, ";");
+        }
+    }
+    lua_concat(L, n * 2 - 1);
+    lua_replace(L, top + 1);
+    lua_settop(L, top + 1);
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, prof->ref);
+    lua_pushvalue(L, top + 1);
+    lua_rawget(L, -2);
+    lua_pushvalue(L, top + 1);
+    lua_pushinteger(L, lua_tointeger(L, -2) + 1);
+    lua_rawset(L, -4);
+    lua_settop(L, top);
+    prof->nsample++;
+}
+
+// returns the id of the function of ar, or 0 on memory allocation error.
+static size_t funcid(lua_State *L, newstate_prof_t *prof, lua_Debug *ar) {
+    const int top = lua_gettop(L);
+    size_t id     = 0;
+
+    lua_getinfo(L, "f", ar);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, prof->ref);
+    lua_pushvalue(L, top + 1);
+    lua_rawget(L, top + 2);
+    if ((id = (size_t)lua_tointeger(L, -1)) == 0) {
+        if (prof->nent == prof->entcap) {
+            size_t cap = prof->entcap ? prof->entcap * 2 : 64;
+            void *p    = realloc(prof->ents, sizeof(*prof->ents) * cap);
+
+            if (!p) {
+                lua_settop(L, top);
+                return 0;
+            }
+            prof->ents   = p;
+            prof->entcap = cap;
+        }
+        id                 = ++prof->nent;
+        prof->ents[id - 1] = (newstate_prof_ent_t){0};
+        // t[fn] = id, t[id] = name
+        lua_getinfo(L, "Sn", ar);
+        pushframename(L, ar);
+        lua_rawseti(L, top + 2, (int)id);
+        lua_pushvalue(L, top + 1);
+        lua_pushinteger(L, (lua_Integer)id);
+        lua_rawset(L, top + 2);
+    }
+    lua_settop(L, top);
+    return id;
+}
+
+static inline void framereturn(newstate_prof_t *prof, uint64_t now) {
+    newstate_prof_frame_t *f = &prof->frames[--prof->nframe];
+    prof->ents[f->id - 1].ns += now - f->start;
+}
+
+void newstate_prof_call(lua_State *L, newstate_prof_t *prof, lua_Debug *ar) {
+    uint64_t now = nanotime();
+
+    switch (ar->event) {
+    case LUA_HOOKCALL:
+#if defined(LUA_HOOKTAILCALL)
+    case LUA_HOOKTAILCALL:
+#endif
+        if (prof->nframe == prof->framecap) {
+            size_t cap = prof->framecap ? prof->framecap * 2 : 64;
+            void *p    = realloc(prof->frames, sizeof(*prof->frames) * cap);
+
+            if (!p) {
+                prof->ndrop++;
+                return;
+            }
+            prof->frames   = p;
+            prof->framecap = cap;
+        }
+        if (prof->ndrop) {
+            prof->ndrop++;
+            return;
+        } else {
+            size_t id = funcid(L, prof, ar);
+
+            if (!id) {
+                prof->ndrop++;
+                return;
+            }
+            prof->ents[id - 1].calls++;
+            prof->frames[prof->nframe++] = (newstate_prof_frame_t){
+                .id    = id,
+                .start = nanotime(),
+#if defined(LUA_HOOKTAILCALL)
+                .tail = ar->event == LUA_HOOKTAILCALL,
+#endif
+            };
+        }
+        return;
+
+    default:
+        // LUA_HOOKRET and LUA_HOOKTAILRET of Lua 5.1
+        if (prof->ndrop) {
+            prof->ndrop--;
+            return;
+        }
+        // the function called by the tail call returns with its caller
+        while (prof->nframe && prof->frames[prof->nframe - 1].tail) {
+            framereturn(prof, now);
+        }
+        if (prof->nframe) {
+            framereturn(prof, now);
+        }
+    }
+}
+
+void newstate_prof_reset(newstate_prof_t *prof) {
+    uint64_t now = nanotime();
+
+    // the frames that did not return by the error
+    while (prof->nframe) {
+        framereturn(prof, now);
+    }
+    prof->ndrop = 0;
+}
+
+static void pushcount(lua_State *L, lua_State *co, newstate_prof_t *prof) {
+    size_t i = 0;
+
+    lua_createtable(L, (int)prof->nent, 0);
+    for (; i < prof->nent; i++) {
+        size_t len       = 0;
+        const char *name = NULL;
+
+        lua_rawgeti(co, -1, (int)i + 1);
+        name = lua_tolstring(co, -1, &len);
+        lua_createtable(L, 0, 3);
+        lua_pushlstring(L, name, len);
+        lua_setfield(L, -2, "name");
+        lua_pushinteger(L, (lua_Integer)prof->ents[i].calls);
+        lua_setfield(L, -2, "calls");
+        lua_pushnumber(L, (lua_Number)prof->ents[i].ns / 1e9);
+        lua_setfield(L, -2, "time");
+        lua_rawseti(L, -2, (int)i + 1);
+        lua_pop(co, 1);
+    }
+}
+
+static void pushsample(lua_State *L, lua_State *co, int collapsed) {
+    luaL_Buffer b;
+
+    if (collapsed) {
+        luaL_buffinit(L, &b);
+    } else {
+        lua_newtable(L);
+    }
+    lua_pushnil(co);
+    while (lua_next(co, -2)) {
+        size_t len      = 0;
+        const char *key = lua_tolstring(co, -2, &len);
+
+        if (collapsed) {
+            luaL_addlstring(&b, key, len);
+            lua_pushfstring(L, " %d\n", (int)lua_tointeger(co, -1));
+            luaL_addvalue(&b);
+        } else {
+            lua_pushlstring(L, key, len);
+            lua_pushinteger(L, lua_tointeger(co, -1));
+            lua_rawset(L, -3);
+        }
+        lua_pop(co, 1);
+    }
+    if (collapsed) {
+        luaL_pushresult(&b);
+    }
+}
+
+void newstate_prof_stop(lua_State *L, lua_State *co, newstate_prof_t *prof,
+                        int collapsed) {
+    const int top = lua_gettop(co);
+
+    newstate_prof_reset(prof);
+    lua_rawgeti(co, LUA_REGISTRYINDEX, prof->ref);
+    if (prof->mode == PROF_COUNT) {
+        pushcount(L, co, prof);
+    } else {
+        pushsample(L, co, collapsed);
+    }
+    lua_settop(co, top);
+    luaL_unref(co, LUA_REGISTRYINDEX, prof->ref);
+    newstate_prof_free(prof);
+}
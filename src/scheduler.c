@@ -0,0 +1,720 @@
+/**
+ *  Copyright (C) 2021 Masatoshi Fukunaga
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ *  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ */
+
+#include "newstate.h"
+#include <errno.h>
+#include <limits.h>
+#include <lualib.h>
+#include <unistd.h>
+
+typedef struct {
+    int refcnt;
+    pthread_mutex_t mutex;
+    pthread_cond_t done_cond;
+    int done;
+    // status of the call, and the packed results or the packed error object
+    int rc;
+    char *data;
+    size_t len;
+} future_t;
+
+typedef struct task_t {
+    struct task_t *prev;
+    struct task_t *next;
+    future_t *fut;
+    // name or source code of the function followed by the packed arguments
+    size_t srclen;
+    size_t len;
+    char data[];
+} task_t;
+
+// queue of the tasks of the worker. the worker takes the tasks from the head
+// and the other workers steal them from the tail.
+typedef struct {
+    pthread_mutex_t mutex;
+    task_t *head;
+    task_t *tail;
+} deque_t;
+
+typedef struct sched_t sched_t;
+
+typedef struct {
+    sched_t *sched;
+    int id;
+    lua_State *L;
+    // reference to the table of the compiled chunks and its number of entries
+    int ref_chunks;
+    size_t nchunk;
+    deque_t deque;
+    pthread_t tid;
+    size_t nrun;
+    size_t nsteal;
+} worker_t;
+
+struct sched_t {
+    pthread_mutex_t mutex;
+    pthread_cond_t pending_cond;
+    int closed;
+    // number of the tasks in the deques
+    size_t npending;
+    int nworker;
+    // maximum number of the compiled chunks cached in each worker
+    size_t maxchunk;
+    // number of the workers whose deque and thread are initialized
+    int ninit;
+    int nthread;
+    // worker to push the next task
+    int next;
+    worker_t workers[];
+};
+
+static inline void future_release(future_t *fut) {
+    if (refcnt_decr(&fut->refcnt) == 0) {
+        pthread_cond_destroy(&fut->done_cond);
+        pthread_mutex_destroy(&fut->mutex);
+        free(fut->data);
+        free(fut);
+    }
+}
+
+static inline void deque_push(deque_t *dq, task_t *task) {
+    pthread_mutex_lock(&dq->mutex);
+    task->next = NULL;
+    task->prev = dq->tail;
+    if (dq->tail) {
+        dq->tail->next = task;
+    } else {
+        dq->head = task;
+    }
+    dq->tail = task;
+    pthread_mutex_unlock(&dq->mutex);
+}
+
+static inline task_t *deque_shift(deque_t *dq) {
+    task_t *task = NULL;
+
+    pthread_mutex_lock(&dq->mutex);
+    if ((task = dq->head)) {
+        dq->head = task->next;
+        if (dq->head) {
+            dq->head->prev = NULL;
+        } else {
+            dq->tail = NULL;
+        }
+    }
+    pthread_mutex_unlock(&dq->mutex);
+    return task;
+}
+
+static inline task_t *deque_steal(deque_t *dq) {
+    task_t *task = NULL;
+
+    // do not wait for the owner or the other thieves
+    if (pthread_mutex_trylock(&dq->mutex) != 0) {
+        return NULL;
+    }
+    if ((task = dq->tail)) {
+        dq->tail = task->prev;
+        if (dq->tail) {
+            dq->tail->next = NULL;
+        } else {
+            dq->head = NULL;
+        }
+    }
+    pthread_mutex_unlock(&dq->mutex);
+    return task;
+}
+
+// caches the function at the top of L as the chunk of the source code at
+// idx. if the cache is full, an arbitrary chunk is evicted.
+static void cachefn(worker_t *w, int idx) {
+    lua_State *L = w->L;
+
+    if (!w->sched->maxchunk) {
+        return;
+    }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, w->ref_chunks);
+    if (w->nchunk >= w->sched->maxchunk) {
+        lua_pushnil(L);
+        if (lua_next(L, -2)) {
+            lua_pop(L, 1);
+            lua_pushnil(L);
+            lua_rawset(L, -3);
+            w->nchunk--;
+        }
+    }
+    lua_pushvalue(L, idx);
+    lua_pushvalue(L, -3);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+    w->nchunk++;
+}
+
+// pushes the global function named src, or the function compiled from src
+// onto L. returns the status of luaL_loadbuffer.
+static int pushfn(worker_t *w, const char *src, size_t len) {
+    lua_State *L = w->L;
+    int rc       = 0;
+
+    lua_settop(L, 0);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, w->ref_chunks);
+    lua_pushlstring(L, src, len);
+    lua_pushglobaltable(L);
+    lua_pushvalue(L, 2);
+    lua_rawget(L, 3);
+    if (!lua_isfunction(L, -1)) {
+        lua_settop(L, 2);
+        lua_pushvalue(L, 2);
+        lua_rawget(L, 1);
+        if (!lua_isfunction(L, -1)) {
+            lua_pop(L, 1);
+            if ((rc = luaL_loadbuffer(L, src, len, src)) == 0) {
+                cachefn(w, 2);
+            }
+        }
+    }
+    lua_replace(L, 1);
+    lua_settop(L, 1);
+    return rc;
+}
+
+// stores the packed results or the packed error object on the stack of L to
+// the future and wakes up the waiters. the error object that cannot be packed
+// is replaced with the message of its type like L:run.
+static void resolve(future_t *fut, lua_State *L, int rc) {
+    newstate_pack_t pk;
+    char *data = NULL;
+    size_t len = 0;
+    int prc    = 0;
+
+    newstate_pack_init(&pk);
+    if (!rc && (prc = newstate_pack(L, 1, lua_gettop(L), &pk))) {
+        newstate_pack_free(&pk);
+        lua_settop(L, 0);
+        if (prc < 0) {
+            lua_pushliteral(L, "not enough memory");
+        } else {
+            lua_pushfstring(L, "cannot return <%s> value",
+                            lua_typename(L, prc));
+        }
+        rc = LUA_ERRRUN;
+    }
+    if (rc && newstate_pack(L, -1, -1, &pk)) {
+        newstate_pack_free(&pk);
+        lua_pushfstring(L, "(error object is a %s value)",
+                        luaL_typename(L, -1));
+        if (newstate_pack(L, -1, -1, &pk)) {
+            newstate_pack_free(&pk);
+        }
+    }
+    if (pk.len && (data = malloc(pk.len))) {
+        memcpy(data, pk.buf, pk.len);
+        len = pk.len;
+    } else if (!rc) {
+        rc = LUA_ERRMEM;
+    }
+    newstate_pack_free(&pk);
+    lua_settop(L, 0);
+
+    pthread_mutex_lock(&fut->mutex);
+    fut->rc   = rc;
+    fut->data = data;
+    fut->len  = len;
+    fut->done = 1;
+    pthread_cond_broadcast(&fut->done_cond);
+    pthread_mutex_unlock(&fut->mutex);
+}
+
+static void runtask(worker_t *w, task_t *task) {
+    lua_State *L     = w->L;
+    const char *args = task->data + task->srclen;
+    int rc           = 0;
+    int n            = 0;
+
+    if ((rc = pushfn(w, task->data, task->srclen)) == 0) {
+        if ((n = newstate_unpack(L, args, task->len)) < 0) {
+            lua_settop(L, 0);
+            lua_pushliteral(L, "malformed packed data");
+            rc = LUA_ERRRUN;
+        } else {
+            rc = lua_pcall(L, n, LUA_MULTRET, 0);
+        }
+    }
+    resolve(task->fut, L, rc);
+    future_release(task->fut);
+    free(task);
+    __atomic_add_fetch(&w->nrun, 1, __ATOMIC_RELAXED);
+}
+
+// takes the task from the own deque, or steals it from the other workers.
+static task_t *taskit(worker_t *w) {
+    sched_t *s   = w->sched;
+    task_t *task = deque_shift(&w->deque);
+    int i        = 1;
+
+    for (; !task && i < s->nworker; i++) {
+        worker_t *victim = &s->workers[(w->id + i) % s->nworker];
+
+        if ((task = deque_steal(&victim->deque))) {
+            __atomic_add_fetch(&w->nsteal, 1, __ATOMIC_RELAXED);
+        }
+    }
+    if (task) {
+        __atomic_sub_fetch(&s->npending, 1, __ATOMIC_ACQ_REL);
+    }
+    return task;
+}
+
+static void *workit(void *arg) {
+    worker_t *w = (worker_t *)arg;
+    sched_t *s  = w->sched;
+    int closed  = 0;
+
+    while (!closed) {
+        task_t *task = taskit(w);
+
+        if (task) {
+            runtask(w, task);
+            continue;
+        }
+        // the tasks are run until the deques are empty even after closed
+        pthread_mutex_lock(&s->mutex);
+        while (!__atomic_load_n(&s->npending, __ATOMIC_ACQUIRE) &&
+               !s->closed) {
+            pthread_cond_wait(&s->pending_cond, &s->mutex);
+        }
+        closed = s->closed && !__atomic_load_n(&s->npending, __ATOMIC_ACQUIRE);
+        pthread_mutex_unlock(&s->mutex);
+    }
+    return NULL;
+}
+
+static inline sched_t *checksched(lua_State *L) {
+    sched_t *s = *(sched_t **)luaL_checkudata(L, 1, SCHEDULER_MT);
+
+    if (!s) {
+        luaL_argerror(L, 1, "scheduler is not initialized");
+    }
+    return s;
+}
+
+static inline future_t *checkfuture(lua_State *L) {
+    return *(future_t **)luaL_checkudata(L, 1, FUTURE_MT);
+}
+
+static int submit_lua(lua_State *L) {
+    sched_t *s      = checksched(L);
+    size_t srclen   = 0;
+    const char *src = luaL_checklstring(L, 2, &srclen);
+    newstate_pack_t pk;
+    future_t **ud = NULL;
+    future_t *fut = NULL;
+    task_t *task  = NULL;
+    int rc        = 0;
+
+    if (s->closed) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "scheduler is closed");
+        return 2;
+    }
+
+    newstate_pack_init(&pk);
+    if ((rc = newstate_pack(L, 3, lua_gettop(L), &pk))) {
+        newstate_pack_free(&pk);
+        lua_pushnil(L);
+        if (rc < 0) {
+            lua_pushliteral(L, "not enough memory");
+        } else {
+            lua_pushfstring(L, "cannot submit <%s> value",
+                            lua_typename(L, rc));
+        }
+        return 2;
+    }
+
+    ud  = lua_newuserdata(L, sizeof(future_t *));
+    *ud = NULL;
+    luaL_getmetatable(L, FUTURE_MT);
+    lua_setmetatable(L, -2);
+    if (!(fut = malloc(sizeof(future_t)))) {
+        goto NOMEM;
+    } else if (pthread_mutex_init(&fut->mutex, NULL) != 0) {
+        free(fut);
+        goto NOMEM;
+    } else if (pthread_cond_init(&fut->done_cond, NULL) != 0) {
+        pthread_mutex_destroy(&fut->mutex);
+        free(fut);
+        goto NOMEM;
+    }
+    fut->refcnt = 1;
+    fut->done   = 0;
+    fut->rc     = 0;
+    fut->data   = NULL;
+    fut->len    = 0;
+    *ud         = fut;
+
+    if (!(task = malloc(sizeof(task_t) + srclen + pk.len))) {
+        goto NOMEM;
+    }
+    memcpy(task->data, src, srclen);
+    memcpy(task->data + srclen, pk.buf, pk.len);
+    task->srclen = srclen;
+    task->len    = pk.len;
+    task->fut    = fut;
+    refcnt_incr(&fut->refcnt);
+    newstate_pack_free(&pk);
+
+    // count the task before it can be taken by the workers
+    __atomic_add_fetch(&s->npending, 1, __ATOMIC_ACQ_REL);
+    deque_push(&s->workers[s->next].deque, task);
+    s->next = (s->next + 1) % s->nworker;
+    pthread_mutex_lock(&s->mutex);
+    pthread_cond_signal(&s->pending_cond);
+    pthread_mutex_unlock(&s->mutex);
+    return 1;
+
+NOMEM:
+    newstate_pack_free(&pk);
+    lua_pushnil(L);
+    lua_pushliteral(L, "not enough memory");
+    return 2;
+}
+
+// waits for the running workers to finish the queued tasks and joins them.
+static void closeit(sched_t *s) {
+    pthread_mutex_lock(&s->mutex);
+    s->closed = 1;
+    pthread_cond_broadcast(&s->pending_cond);
+    pthread_mutex_unlock(&s->mutex);
+    for (; s->nthread; s->nthread--) {
+        pthread_join(s->workers[s->nthread - 1].tid, NULL);
+    }
+}
+
+static int close_lua(lua_State *L) {
+    closeit(checksched(L));
+    return 0;
+}
+
+static int stats_lua(lua_State *L) {
+    sched_t *s = checksched(L);
+    int i      = 0;
+
+    lua_createtable(L, 0, 2);
+    lua_pushinteger(L, (lua_Integer)__atomic_load_n(&s->npending,
+                                                    __ATOMIC_RELAXED));
+    lua_setfield(L, -2, "pending");
+    lua_createtable(L, s->nworker, 0);
+    for (; i < s->nworker; i++) {
+        worker_t *w = &s->workers[i];
+
+        lua_createtable(L, 0, 2);
+        lua_pushinteger(L, (lua_Integer)__atomic_load_n(&w->nrun,
+                                                        __ATOMIC_RELAXED));
+        lua_setfield(L, -2, "runs");
+        lua_pushinteger(L, (lua_Integer)__atomic_load_n(&w->nsteal,
+                                                        __ATOMIC_RELAXED));
+        lua_setfield(L, -2, "steals");
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_setfield(L, -2, "workers");
+    return 1;
+}
+
+static int tostring_lua(lua_State *L) {
+    lua_pushfstring(L, SCHEDULER_MT ": %p", lua_touserdata(L, 1));
+    return 1;
+}
+
+static int gc_lua(lua_State *L) {
+    sched_t **ud = (sched_t **)lua_touserdata(L, 1);
+    sched_t *s   = *ud;
+    int i        = 0;
+
+    if (s) {
+        *ud = NULL;
+        closeit(s);
+        for (; i < s->nworker; i++) {
+            if (s->workers[i].L) {
+                lua_close(s->workers[i].L);
+            }
+        }
+        for (i = 0; i < s->ninit; i++) {
+            pthread_mutex_destroy(&s->workers[i].deque.mutex);
+        }
+        pthread_cond_destroy(&s->pending_cond);
+        pthread_mutex_destroy(&s->mutex);
+        free(s);
+    }
+    return 0;
+}
+
+// pushes the results of the future like L:run.
+static int pushresult(lua_State *L, future_t *fut) {
+    int n = 0;
+
+    if (fut->rc) {
+        lua_pushboolean(L, 0);
+        if (!fut->data) {
+            lua_pushliteral(L, "not enough memory");
+        } else if (newstate_unpack(L, fut->data, fut->len) != 1) {
+            return luaL_error(L, "malformed packed data");
+        }
+        lua_pushinteger(L, fut->rc);
+        return 3;
+    }
+    lua_pushboolean(L, 1);
+    if ((n = newstate_unpack(L, fut->data, fut->len)) < 0) {
+        return luaL_error(L, "malformed packed data");
+    }
+    return 1 + n;
+}
+
+static int waitit(lua_State *L, future_t *fut, lua_Number timeout) {
+    struct timespec deadline;
+    int done = 0;
+
+    if (timeout > 0) {
+        deadlineit(&deadline, timeout);
+    }
+
+    pthread_mutex_lock(&fut->mutex);
+    while (!fut->done && timeout != 0) {
+        if (timeout < 0) {
+            pthread_cond_wait(&fut->done_cond, &fut->mutex);
+        } else if (pthread_cond_timedwait(&fut->done_cond, &fut->mutex,
+                                          &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    done = fut->done;
+    pthread_mutex_unlock(&fut->mutex);
+
+    if (!done) {
+        lua_pushnil(L);
+        return 1;
+    }
+    lua_settop(L, 1);
+    return pushresult(L, fut);
+}
+
+static int future_wait_lua(lua_State *L) {
+    future_t *fut = checkfuture(L);
+    return waitit(L, fut, luaL_optnumber(L, 2, -1));
+}
+
+static int future_poll_lua(lua_State *L) {
+    future_t *fut = checkfuture(L);
+    return waitit(L, fut, 0);
+}
+
+static int future_tostring_lua(lua_State *L) {
+    lua_pushfstring(L, FUTURE_MT ": %p", lua_touserdata(L, 1));
+    return 1;
+}
+
+static int future_gc_lua(lua_State *L) {
+    future_t **fut = (future_t **)lua_touserdata(L, 1);
+
+    if (*fut) {
+        future_release(*fut);
+        *fut = NULL;
+    }
+    return 0;
+}
+
+void newstate_scheduler_init(lua_State *L) {
+    struct luaL_Reg mmethods[] = {
+        {"__gc", gc_lua},
+        {"__tostring", tostring_lua},
+        {NULL, NULL},
+    };
+    struct luaL_Reg methods[] = {
+        {"submit", submit_lua},
+        {"close", close_lua},
+        {"stats", stats_lua},
+        {NULL, NULL},
+    };
+    struct luaL_Reg future_mmethods[] = {
+        {"__gc", future_gc_lua},
+        {"__tostring", future_tostring_lua},
+        {NULL, NULL},
+    };
+    struct luaL_Reg future_methods[] = {
+        {"wait", future_wait_lua},
+        {"poll", future_poll_lua},
+        {NULL, NULL},
+    };
+
+    newstate_createmetatable(L, SCHEDULER_MT, mmethods, methods);
+    newstate_createmetatable(L, FUTURE_MT, future_mmethods, future_methods);
+}
+
+// creates the child state of the worker and runs the preload code in it.
+// returns 0 on success, or pushes the error message onto L and returns -1.
+static int initworker(lua_State *L, worker_t *w, const char *preload,
+                      size_t len) {
+    if (!(w->L = luaL_newstate())) {
+        lua_pushliteral(L, "not enough memory");
+        return -1;
+    }
+    luaL_openlibs(w->L);
+    lua_newtable(w->L);
+    w->ref_chunks = luaL_ref(w->L, LUA_REGISTRYINDEX);
+    if (preload && (luaL_loadbuffer(w->L, preload, len, preload) ||
+                    lua_pcall(w->L, 0, 0, 0))) {
+        const char *err = lua_tostring(w->L, -1);
+
+        lua_pushstring(L, err ? err : "failed to run opts.preload");
+        return -1;
+    }
+    lua_settop(w->L, 0);
+    return 0;
+}
+
+// default maximum number of the compiled chunks cached in each worker
+#define SCHED_CHUNKCACHE 64
+
+// raises the error if opts has the option that the scheduler does not
+// support, e.g. the memory limit of newstate.new(), since the workers would
+// silently run without it.
+static void checkopts(lua_State *L) {
+    static const char *const names[] = {"workers", "preload", "chunkcache",
+                                        NULL};
+
+    lua_pushnil(L);
+    while (lua_next(L, 1)) {
+        const char *const *name = names;
+        const char *key         = NULL;
+
+        lua_pop(L, 1);
+        if (lua_type(L, -1) != LUA_TSTRING) {
+            luaL_argerror(L, 1, "opts must not have non-string keys");
+        }
+        key = lua_tostring(L, -1);
+        for (; *name && strcmp(*name, key) != 0; name++) {
+        }
+        if (!*name) {
+            luaL_argerror(L, 1,
+                          lua_pushfstring(L, "opts.%s is not supported by "
+                                             "the scheduler",
+                                          key));
+        }
+    }
+}
+
+int newstate_scheduler_lua(lua_State *L) {
+    long ncpu           = sysconf(_SC_NPROCESSORS_ONLN);
+    lua_Integer nworker = ncpu > 0 ? ncpu : 1;
+    lua_Integer nchunk  = SCHED_CHUNKCACHE;
+    const char *preload = NULL;
+    size_t len          = 0;
+    sched_t **ud        = NULL;
+    sched_t *s          = NULL;
+    int rc              = 0;
+    int i               = 0;
+
+    lua_settop(L, 1);
+    if (!lua_isnil(L, 1)) {
+        luaL_checktype(L, 1, LUA_TTABLE);
+        checkopts(L);
+        lua_getfield(L, 1, "workers");
+        if (!lua_isnil(L, -1)) {
+            luaL_argcheck(L, lua_type(L, -1) == LUA_TNUMBER, 1,
+                          "opts.workers must be integer");
+            nworker = lua_tointeger(L, -1);
+            luaL_argcheck(L, nworker > 0 && nworker <= INT_MAX, 1,
+                          "opts.workers must be greater than 0");
+        }
+        lua_pop(L, 1);
+        lua_getfield(L, 1, "preload");
+        if (!lua_isnil(L, -1)) {
+            luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING, 1,
+                          "opts.preload must be string");
+            preload = lua_tolstring(L, -1, &len);
+        }
+        lua_getfield(L, 1, "chunkcache");
+        if (!lua_isnil(L, -1)) {
+            luaL_argcheck(L, lua_type(L, -1) == LUA_TNUMBER, 1,
+                          "opts.chunkcache must be integer");
+            nchunk = lua_tointeger(L, -1);
+            luaL_argcheck(L, nchunk >= 0, 1,
+                          "opts.chunkcache must be greater than or equal to "
+                          "0");
+        }
+        lua_settop(L, 1);
+    }
+
+    ud  = lua_newuserdata(L, sizeof(sched_t *));
+    *ud = NULL;
+    luaL_getmetatable(L, SCHEDULER_MT);
+    lua_setmetatable(L, -2);
+    if (!(s = calloc(1, sizeof(sched_t) +
+                            sizeof(worker_t) * (size_t)nworker))) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "not enough memory");
+        return 2;
+    } else if ((rc = pthread_mutex_init(&s->mutex, NULL))) {
+        free(s);
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(rc));
+        return 2;
+    } else if ((rc = pthread_cond_init(&s->pending_cond, NULL))) {
+        pthread_mutex_destroy(&s->mutex);
+        free(s);
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(rc));
+        return 2;
+    }
+    s->nworker  = (int)nworker;
+    s->maxchunk = (size_t)nchunk;
+    // the scheduler is released by __gc on failure
+    *ud = s;
+
+    for (; i < s->nworker; i++) {
+        worker_t *w = &s->workers[i];
+
+        w->sched      = s;
+        w->id         = i;
+        w->ref_chunks = LUA_NOREF;
+        if ((rc = pthread_mutex_init(&w->deque.mutex, NULL))) {
+            lua_pushnil(L);
+            lua_pushstring(L, strerror(rc));
+            return 2;
+        }
+        s->ninit++;
+        if (initworker(L, w, preload, len)) {
+            lua_pushnil(L);
+            lua_insert(L, -2);
+            return 2;
+        }
+    }
+    for (i = 0; i < s->nworker; i++) {
+        if ((rc = pthread_create(&s->workers[i].tid, NULL, workit,
+                                 &s->workers[i]))) {
+            lua_pushnil(L);
+            lua_pushstring(L, strerror(rc));
+            return 2;
+        }
+        s->nthread++;
+    }
+    return 1;
+}
@@ -0,0 +1,644 @@
+/**
+ *  Copyright (C) 2021 Masatoshi Fukunaga
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ *  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ */
+
+#include "newstate.h"
+
+// registry field of the table that maps the frozen tables to their userdata
+// in each state, so that the same table is always the same userdata.
+#define SHARED_CACHE SHARED_MT ".cache"
+
+// types of the frozen values
+enum {
+    SV_NIL = 0,
+    SV_FALSE,
+    SV_TRUE,
+    SV_INT,
+    SV_NUM,
+    SV_STR,
+    SV_TBL,
+};
+
+typedef struct {
+    int type;
+    union {
+        lua_Integer i;
+        lua_Number n;
+        // offset and length of the string in the string pool
+        struct {
+            size_t off;
+            size_t len;
+        } s;
+        // index of the table
+        size_t tbl;
+    } u;
+} sval_t;
+
+typedef struct {
+    uint64_t hash;
+    sval_t key;
+    sval_t val;
+} sslot_t;
+
+typedef struct {
+    // values of the keys from 1 to narr
+    size_t narr;
+    sval_t *arr;
+    // open addressing hash of the other fields. nslot is a power of 2, and
+    // the slot whose key is SV_NIL is empty.
+    size_t nslot;
+    sslot_t *slots;
+} stbl_t;
+
+struct newstate_shared_t {
+    int refcnt;
+    // the first table is the root
+    stbl_t *tbls;
+    size_t ntbl;
+    size_t tblcap;
+    char *strs;
+    size_t strlen;
+    size_t strcap;
+};
+
+// key to look up or to insert
+typedef struct {
+    int type;
+    const char *s;
+    size_t len;
+    lua_Integer i;
+    lua_Number n;
+    uint64_t hash;
+} skey_t;
+
+static void release(newstate_shared_t *sh) {
+    size_t i = 0;
+
+    if (refcnt_decr(&sh->refcnt) == 0) {
+        for (; i < sh->ntbl; i++) {
+            free(sh->tbls[i].arr);
+            free(sh->tbls[i].slots);
+        }
+        free(sh->tbls);
+        free(sh->strs);
+        free(sh);
+    }
+}
+
+static inline uint64_t mixit(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// converts the value at idx to the key. the number that has an integer value
+// is converted to the integer like the keys of the table. returns 0, or the
+// type of the value that cannot be a key.
+static int tokey(lua_State *L, int idx, skey_t *k) {
+    uint64_t bits = 0;
+
+    switch (lua_type(L, idx)) {
+    case LUA_TBOOLEAN:
+        k->type = lua_toboolean(L, idx) ? SV_TRUE : SV_FALSE;
+        k->hash = mixit((uint64_t)k->type);
+        return 0;
+
+    case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+        if (lua_isinteger(L, idx)) {
+            k->type = SV_INT;
+            k->i    = lua_tointeger(L, idx);
+            k->hash = mixit((uint64_t)k->i);
+            return 0;
+        }
+        k->n = lua_tonumber(L, idx);
+        if (k->n >= -0x1p63 && k->n < 0x1p63 &&
+            (lua_Number)(lua_Integer)k->n == k->n) {
+            k->type = SV_INT;
+            k->i    = (lua_Integer)k->n;
+            k->hash = mixit((uint64_t)k->i);
+            return 0;
+        }
+#else
+        k->n = lua_tonumber(L, idx);
+#endif
+        if (k->n != k->n) {
+            return LUA_TNUMBER;
+        } else if (k->n == 0) {
+            // -0 and 0 are the same key
+            k->n = 0;
+        }
+        k->type = SV_NUM;
+        memcpy(&bits, &k->n, sizeof(bits) < sizeof(k->n) ? sizeof(bits)
+                                                         : sizeof(k->n));
+        k->hash = mixit(bits);
+        return 0;
+
+    case LUA_TSTRING: {
+        uint64_t h = 0xcbf29ce484222325ULL;
+        size_t i   = 0;
+
+        k->type = SV_STR;
+        k->s    = lua_tolstring(L, idx, &k->len);
+        // FNV-1a
+        for (; i < k->len; i++) {
+            h ^= (unsigned char)k->s[i];
+            h *= 0x100000001b3ULL;
+        }
+        k->hash = h;
+        return 0;
+    }
+
+    default:
+        return lua_type(L, idx);
+    }
+}
+
+// returns the index of the array part for the key plus 1, or 0.
+static inline size_t arrayindex(stbl_t *t, skey_t *k) {
+#if LUA_VERSION_NUM >= 503
+    if (k->type == SV_INT && k->i >= 1 && (uint64_t)k->i <= t->narr) {
+        return (size_t)k->i;
+    }
+#else
+    if (k->type == SV_NUM && k->n >= 1 && k->n <= (lua_Number)t->narr &&
+        k->n == (lua_Number)(size_t)k->n) {
+        return (size_t)k->n;
+    }
+#endif
+    return 0;
+}
+
+// returns the slot of the key, or NULL.
+static sslot_t *findslot(newstate_shared_t *sh, stbl_t *t, skey_t *k) {
+    size_t mask = t->nslot - 1;
+    size_t i    = 0;
+
+    if (!t->nslot) {
+        return NULL;
+    }
+    for (i = k->hash & mask; t->slots[i].key.type != SV_NIL;
+         i = (i + 1) & mask) {
+        sslot_t *slot = &t->slots[i];
+
+        if (slot->hash != k->hash || slot->key.type != k->type) {
+            continue;
+        }
+        switch (k->type) {
+        case SV_INT:
+            if (slot->key.u.i == k->i) {
+                return slot;
+            }
+            break;
+        case SV_NUM:
+            if (slot->key.u.n == k->n) {
+                return slot;
+            }
+            break;
+        case SV_STR:
+            if (slot->key.u.s.len == k->len &&
+                memcmp(sh->strs + slot->key.u.s.off, k->s, k->len) == 0) {
+                return slot;
+            }
+            break;
+        default:
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+static const sval_t *lookup(newstate_shared_t *sh, stbl_t *t, skey_t *k) {
+    size_t i      = arrayindex(t, k);
+    sslot_t *slot = NULL;
+
+    if (i) {
+        return &t->arr[i - 1];
+    } else if ((slot = findslot(sh, t, k))) {
+        return &slot->val;
+    }
+    return NULL;
+}
+
+static void pushval(lua_State *L, newstate_shared_t *sh, const sval_t *v) {
+    switch (v->type) {
+    case SV_FALSE:
+    case SV_TRUE:
+        lua_pushboolean(L, v->type == SV_TRUE);
+        return;
+    case SV_INT:
+        lua_pushinteger(L, v->u.i);
+        return;
+    case SV_NUM:
+        lua_pushnumber(L, v->u.n);
+        return;
+    case SV_STR:
+        lua_pushlstring(L, sh->strs + v->u.s.off, v->u.s.len);
+        return;
+    case SV_TBL: {
+        newstate_shared_ref_t ref = {sh, &sh->tbls[v->u.tbl]};
+        newstate_shared_push(L, &ref);
+        return;
+    }
+    default:
+        lua_pushnil(L);
+    }
+}
+
+static inline newstate_shared_ref_t *checkshared(lua_State *L) {
+    newstate_shared_ref_t *ref = luaL_checkudata(L, 1, SHARED_MT);
+
+    if (!ref->tbl) {
+        luaL_argerror(L, 1, "shared table is not initialized");
+    }
+    return ref;
+}
+
+static int index_lua(lua_State *L) {
+    newstate_shared_ref_t *ref = checkshared(L);
+    const sval_t *v            = NULL;
+    skey_t k;
+
+    if (tokey(L, 2, &k) == 0 &&
+        (v = lookup(ref->sh, (stbl_t *)ref->tbl, &k))) {
+        pushval(L, ref->sh, v);
+        return 1;
+    }
+    lua_pushnil(L);
+    return 1;
+}
+
+static int newindex_lua(lua_State *L) {
+    checkshared(L);
+    return luaL_error(L, "attempt to modify a shared table");
+}
+
+static int len_lua(lua_State *L) {
+    newstate_shared_ref_t *ref = checkshared(L);
+    lua_pushinteger(L, (lua_Integer)((stbl_t *)ref->tbl)->narr);
+    return 1;
+}
+
+static int next_lua(lua_State *L) {
+    newstate_shared_ref_t *ref = checkshared(L);
+    stbl_t *t                  = (stbl_t *)ref->tbl;
+    size_t pos                 = 0;
+    skey_t k;
+
+    lua_settop(L, 2);
+    if (!lua_isnil(L, 2)) {
+        sslot_t *slot = NULL;
+
+        if (tokey(L, 2, &k) != 0) {
+            return luaL_error(L, "invalid key to 'next'");
+        } else if ((pos = arrayindex(t, &k)) == 0) {
+            if (!(slot = findslot(ref->sh, t, &k))) {
+                return luaL_error(L, "invalid key to 'next'");
+            }
+            pos = t->narr + (size_t)(slot - t->slots) + 1;
+        }
+    }
+
+    for (; pos < t->narr; pos++) {
+        if (t->arr[pos].type != SV_NIL) {
+            lua_pushinteger(L, (lua_Integer)pos + 1);
+            pushval(L, ref->sh, &t->arr[pos]);
+            return 2;
+        }
+    }
+    for (pos -= t->narr; pos < t->nslot; pos++) {
+        if (t->slots[pos].key.type != SV_NIL) {
+            pushval(L, ref->sh, &t->slots[pos].key);
+            pushval(L, ref->sh, &t->slots[pos].val);
+            return 2;
+        }
+    }
+    lua_pushnil(L);
+    return 1;
+}
+
+static int pairs_lua(lua_State *L) {
+    checkshared(L);
+    lua_pushcfunction(L, next_lua);
+    lua_pushvalue(L, 1);
+    lua_pushnil(L);
+    return 3;
+}
+
+static int tostring_lua(lua_State *L) {
+    lua_pushfstring(L, SHARED_MT ": %p", lua_touserdata(L, 1));
+    return 1;
+}
+
+static int gc_lua(lua_State *L) {
+    newstate_shared_ref_t *ref = (newstate_shared_ref_t *)lua_touserdata(L, 1);
+
+    if (ref->sh) {
+        release(ref->sh);
+        ref->sh  = NULL;
+        ref->tbl = NULL;
+    }
+    return 0;
+}
+
+void newstate_shared_init(lua_State *L) {
+    struct luaL_Reg mmethods[] = {
+        {"__gc", gc_lua},
+        {"__index", index_lua},
+        {"__newindex", newindex_lua},
+        {"__len", len_lua},
+        {"__pairs", pairs_lua},
+        {"__tostring", tostring_lua},
+        {NULL, NULL},
+    };
+    struct luaL_Reg *fn = mmethods;
+
+    luaL_getmetatable(L, SHARED_MT);
+    if (lua_isnil(L, -1)) {
+        // the fields are looked up by __index, so it has no methods
+        luaL_newmetatable(L, SHARED_MT);
+        for (; fn->name; fn++) {
+            lua_pushstring(L, fn->name);
+            lua_pushcfunction(L, fn->func);
+            lua_rawset(L, -3);
+        }
+        lua_pop(L, 1);
+
+        lua_newtable(L);
+        lua_createtable(L, 0, 1);
+        lua_pushliteral(L, "v");
+        lua_setfield(L, -2, "__mode");
+        lua_setmetatable(L, -2);
+        lua_setfield(L, LUA_REGISTRYINDEX, SHARED_CACHE);
+    }
+    lua_pop(L, 1);
+}
+
+void newstate_shared_push(lua_State *L, newstate_shared_ref_t *ref) {
+    newstate_shared_ref_t *ud = NULL;
+
+    newstate_shared_init(L);
+    lua_getfield(L, LUA_REGISTRYINDEX, SHARED_CACHE);
+    lua_pushlightuserdata(L, (void *)ref->tbl);
+    lua_rawget(L, -2);
+    if (!lua_isnil(L, -1)) {
+        lua_remove(L, -2);
+        return;
+    }
+    lua_pop(L, 1);
+
+    ud  = lua_newuserdata(L, sizeof(newstate_shared_ref_t));
+    *ud = (newstate_shared_ref_t){NULL, NULL};
+    luaL_getmetatable(L, SHARED_MT);
+    lua_setmetatable(L, -2);
+    refcnt_incr(&ref->sh->refcnt);
+    *ud = *ref;
+    // cache[tbl] = ud
+    lua_pushlightuserdata(L, (void *)ref->tbl);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, -4);
+    lua_remove(L, -2);
+}
+
+// appends the string to the string pool and sets it to v.
+static int putstr(newstate_shared_t *sh, const char *s, size_t len,
+                  sval_t *v) {
+    if (sh->strcap - sh->strlen < len) {
+        size_t cap = sh->strcap ? sh->strcap : 4096;
+        char *strs = NULL;
+
+        while (cap - sh->strlen < len) {
+            cap *= 2;
+        }
+        if (!(strs = realloc(sh->strs, cap))) {
+            return -1;
+        }
+        sh->strs   = strs;
+        sh->strcap = cap;
+    }
+    memcpy(sh->strs + sh->strlen, s, len);
+    v->type     = SV_STR;
+    v->u.s.off  = sh->strlen;
+    v->u.s.len  = len;
+    sh->strlen += len;
+    return 0;
+}
+
+// registers the table at idx with a new index in the seen table at sidx.
+// its contents are frozen later by freezetbl().
+static int registertbl(lua_State *L, newstate_shared_t *sh, int sidx,
+                       int idx, sval_t *v) {
+    const lua_Integer id = (lua_Integer)sh->ntbl + 1;
+
+    if (sh->ntbl == sh->tblcap) {
+        size_t cap   = sh->tblcap ? sh->tblcap * 2 : 16;
+        stbl_t *tbls = realloc(sh->tbls, sizeof(stbl_t) * cap);
+
+        if (!tbls) {
+            return -1;
+        }
+        sh->tbls   = tbls;
+        sh->tblcap = cap;
+    }
+    sh->tbls[sh->ntbl++] = (stbl_t){0, NULL, 0, NULL};
+    // seen[tbl] = id, seen[id] = tbl
+    lua_pushvalue(L, idx);
+    lua_pushinteger(L, id);
+    lua_rawset(L, sidx);
+    lua_pushvalue(L, idx);
+    lua_rawseti(L, sidx, (int)id);
+    v->type  = SV_TBL;
+    v->u.tbl = (size_t)id - 1;
+    return 0;
+}
+
+// converts the value at idx to v. returns 0, -1 on memory allocation error,
+// or the type of the value that cannot be frozen.
+static int toval(lua_State *L, newstate_shared_t *sh, int sidx, int idx,
+                 sval_t *v) {
+    size_t len    = 0;
+    const char *s = NULL;
+
+    idx = absindex(L, idx);
+    switch (lua_type(L, idx)) {
+    case LUA_TBOOLEAN:
+        v->type = lua_toboolean(L, idx) ? SV_TRUE : SV_FALSE;
+        return 0;
+
+    case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+        if (lua_isinteger(L, idx)) {
+            v->type = SV_INT;
+            v->u.i  = lua_tointeger(L, idx);
+            return 0;
+        }
+#endif
+        v->type = SV_NUM;
+        v->u.n  = lua_tonumber(L, idx);
+        return 0;
+
+    case LUA_TSTRING:
+        s = lua_tolstring(L, idx, &len);
+        return putstr(sh, s, len, v);
+
+    case LUA_TTABLE:
+        lua_pushvalue(L, idx);
+        lua_rawget(L, sidx);
+        if (!lua_isnil(L, -1)) {
+            v->type  = SV_TBL;
+            v->u.tbl = (size_t)lua_tointeger(L, -1) - 1;
+            lua_pop(L, 1);
+            return 0;
+        }
+        lua_pop(L, 1);
+        return registertbl(L, sh, sidx, idx, v);
+
+    default:
+        return lua_type(L, idx);
+    }
+}
+
+// freezes the contents of the table i that is on the top of L.
+static int freezetbl(lua_State *L, newstate_shared_t *sh, int sidx, size_t i) {
+    const int tidx = lua_gettop(L);
+    int narr       = 0;
+    int nrec       = 0;
+    size_t nslot   = 0;
+    int rc         = 0;
+    int j          = 0;
+    sval_t v;
+
+    tblsize(L, tidx, &narr, &nrec);
+    if (nrec) {
+        for (nslot = 1; nslot < (size_t)nrec * 2; nslot *= 2) {
+        }
+    }
+    if ((narr && !(sh->tbls[i].arr = calloc((size_t)narr, sizeof(sval_t)))) ||
+        (nslot && !(sh->tbls[i].slots = calloc(nslot, sizeof(sslot_t))))) {
+        return -1;
+    }
+    sh->tbls[i].narr  = (size_t)narr;
+    sh->tbls[i].nslot = nslot;
+
+    for (j = 1; j <= narr; j++) {
+        lua_rawgeti(L, tidx, j);
+        if (!lua_isnil(L, -1)) {
+            if ((rc = toval(L, sh, sidx, -1, &v))) {
+                return rc;
+            }
+            // the tables may be reallocated by toval()
+            sh->tbls[i].arr[j - 1] = v;
+        }
+        lua_pop(L, 1);
+    }
+
+    lua_pushnil(L);
+    while (lua_next(L, tidx) != 0) {
+        if (!isarraykey(L, -2, narr)) {
+            sslot_t slot = {0};
+            skey_t k;
+            size_t mask = nslot - 1;
+            size_t s    = 0;
+
+            if ((rc = tokey(L, -2, &k)) ||
+                (rc = toval(L, sh, sidx, -2, &slot.key)) ||
+                (rc = toval(L, sh, sidx, -1, &slot.val))) {
+                return rc;
+            }
+            slot.hash = k.hash;
+            for (s = k.hash & mask; sh->tbls[i].slots[s].key.type != SV_NIL;
+                 s = (s + 1) & mask) {
+            }
+            sh->tbls[i].slots[s] = slot;
+        }
+        lua_pop(L, 1);
+    }
+    return 0;
+}
+
+// freezes the table at idx and the tables referenced from it without
+// recursion.
+static int freeze(lua_State *L, newstate_shared_t *sh, int idx) {
+    const int top = lua_gettop(L);
+    int sidx      = 0;
+    size_t i      = 0;
+    int rc        = 0;
+    sval_t v;
+
+    lua_newtable(L);
+    sidx = lua_gettop(L);
+    if ((rc = registertbl(L, sh, sidx, idx, &v))) {
+        lua_settop(L, top);
+        return rc;
+    }
+    for (; i < sh->ntbl; i++) {
+        lua_rawgeti(L, sidx, (int)i + 1);
+        if ((rc = freezetbl(L, sh, sidx, i))) {
+            lua_settop(L, top);
+            return rc;
+        }
+        lua_pop(L, 1);
+    }
+    lua_settop(L, top);
+    return 0;
+}
+
+int newstate_shared_lua(lua_State *L) {
+    newstate_shared_ref_t *ud = NULL;
+    newstate_shared_t *sh     = NULL;
+    int rc                    = 0;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_settop(L, 1);
+    newstate_shared_init(L);
+    ud  = lua_newuserdata(L, sizeof(newstate_shared_ref_t));
+    *ud = (newstate_shared_ref_t){NULL, NULL};
+    luaL_getmetatable(L, SHARED_MT);
+    lua_setmetatable(L, -2);
+    if (!(sh = calloc(1, sizeof(newstate_shared_t)))) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "not enough memory");
+        return 2;
+    }
+    // the partially frozen data is released by __gc on error
+    sh->refcnt = 1;
+    ud->sh     = sh;
+    if ((rc = freeze(L, sh, 1))) {
+        lua_pushnil(L);
+        if (rc < 0) {
+            lua_pushliteral(L, "not enough memory");
+        } else {
+            lua_pushfstring(L, "cannot freeze <%s> value", lua_typename(L, rc));
+        }
+        return 2;
+    }
+    ud->tbl = &sh->tbls[0];
+
+    // cache[tbl] = ud
+    lua_getfield(L, LUA_REGISTRYINDEX, SHARED_CACHE);
+    lua_pushlightuserdata(L, (void *)ud->tbl);
+    lua_pushvalue(L, 2);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+    return 1;
+}